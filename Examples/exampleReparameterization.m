@@ -148,3 +148,26 @@ plot([-1,1],[-1,1],'--k');
 
 linkaxes([ax1, ax2]);
 
+%%
+%The simulator can also run the full Kalman filter in closed loop, instead of the
+%reparameterized (alpha, beta) plant. Here, the simulated user's control vector
+%is encoded by the same number of neural features as above, with the same noise level.
+simOpts = makeBciSimOptions( );
+simOpts.plant.decoderType = 1;
+simOpts.plant.K = kalmanGain;
+simOpts.plant.A = A;
+simOpts.plant.H = C;
+simOpts.noiseMatrix = randn(10000, nNeurons)*2;
+
+nTrials = 8;
+simOut = simBatch( simOpts, targList, zeros(nTrials,2) );
+
+figure;
+hold on;
+for t=1:nTrials
+    loopIdx = simOut.reachEpochs(t,1):simOut.reachEpochs(t,2);
+    plot(simOut.pos(loopIdx,1), simOut.pos(loopIdx,2));
+end
+axis equal;
+title('Simulated Closed-Loop Trajectories (Kalman Filter)');
+disp(['Mean Movement Time (Kalman Filter): ' num2str(mean(simOut.movTime)) ' s']);
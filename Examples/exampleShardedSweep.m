@@ -0,0 +1,84 @@
+%%
+%This example script shows how to split a large parameter sweep into shards
+%that are run by several worker processes (on one machine here, but the
+%queue directory can also be on a filesystem shared by several machines).
+%The .mex file should be compiled first (compileSimBci.m), and the "Tools"
+%folder must be on the MATLAB path of the worker processes.
+
+%%
+%Describe the sweep as a list of jobs, where each job is one simBatch call.
+opts = makeBciSimOptions( );
+opts.trial.dwellTime = 1.0;
+
+alpha = fliplr(1-logspace(log10(0.005),log10(0.8),6));
+beta = logspace(log10(0.3),log10(6.25),8);
+nTrials = 50;
+
+jobs = struct('opts',{},'targPos',{},'startPos',{});
+for a=1:length(alpha)
+    for b=1:length(beta)
+        jobs(end+1).opts = opts;
+        jobs(end).opts.plant.alpha = alpha(a);
+        jobs(end).opts.plant.beta = beta(b);
+        jobs(end).targPos = repmat([1 0], nTrials, 1);
+        jobs(end).startPos = repmat([0 0], nTrials, 1);
+    end
+end
+
+%Each job gets its own noise, drawn with a seed derived from its index, so the
+%results are the same no matter how many workers run the sweep.
+noiseFcn = @(opts)randn(10000, opts.plant.nDim)*1.5;
+
+%%
+%Write the work queue and start the worker processes.
+queueDir = tempname;
+nShards = 12;
+makeSimShards( queueDir, jobs, nShards, noiseFcn, 1 );
+
+%Time one job before the workers start, to estimate how long a shard takes.
+rng(1, 'twister');
+testOpts = jobs(1).opts;
+testOpts.noiseMatrix = noiseFcn(testOpts);
+jobTimer = tic;
+simBatch( testOpts, jobs(1).targPos, jobs(1).startPos );
+shardTime = toc(jobTimer) * ceil(length(jobs)/nShards);
+
+nWorkers = 4;
+toolsDir = fileparts(which('simBatch'));
+for w=1:nWorkers
+    system(['"' fullfile(matlabroot,'bin','matlab') '" -batch "addpath(''' toolsDir '''); runSimShardWorker(''' queueDir ''')" &']);
+end
+
+%This session works on the queue as well, until every shard is done. When it runs
+%out of shards to claim, it waits for the other workers, and re-claims any shard
+%that has been claimed for more than staleTime seconds without finishing (e.g.
+%because its worker died), so a crashed worker cannot stall the sweep. staleTime
+%must be well above the time a shard takes, or shards that are still running are
+%re-claimed and run twice, so it is derived from the estimated shard time (with
+%a generous margin, since the workers share this machine's cores).
+staleTime = max(300, 20*shardTime);
+while length(dir(fullfile(queueDir,'done',[simShardName() '.mat']))) < nShards
+    runSimShardWorker( queueDir, staleTime );
+    pause(1);
+end
+
+out = mergeSimShards( queueDir );
+
+%%
+%Running the same sweep with a single worker gives identical results.
+queueDirSingle = tempname;
+makeSimShards( queueDirSingle, jobs, 3, noiseFcn, 1 );
+runSimShardWorker( queueDirSingle );
+outSingle = mergeSimShards( queueDirSingle );
+disp(['Identical to single-worker run: ' num2str(isequal(out, outSingle))]);
+
+%Summarize the sweep.
+timeMat = reshape(cellfun(@(x)mean(x.movTime), out), length(beta), length(alpha))';
+figure
+imagesc(timeMat, [0 10]);
+colormap(jet);
+set(gca,'YDir','normal');
+xlabel('Beta Index');
+ylabel('Alpha Index');
+title('Average Movement Time (s)');
+colorbar;
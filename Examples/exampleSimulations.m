@@ -178,3 +178,25 @@ plot(visDelay, meanMovTime, '-o');
 xlabel('Feedback Delay (# of steps)');
 ylabel('Mean Movement Time (s)');
 
+%%
+%This section memoizes simBatch results on disk. A configuration blob made with
+%simBci 'init' or 'set' is part of the cache key, so two blobs that differ only
+%in alpha are two cache misses, while repeating a call is a hit.
+opts = defaultOpts;
+opts.cache.dir = tempname;
+opts.cache.noiseKey = 'randn*1.5, exampleSimulations';
+opts.configBlob = simBci( opts, 'init' );
+blobAlpha = simBci( struct('alpha', 0.5), 'set' );
+
+simBatchCache( 'resetStats' );
+simBatch( opts, targPos, startPos );
+optsAlpha = opts;
+optsAlpha.configBlob = blobAlpha;
+simBatch( optsAlpha, targPos, startPos );
+stats = simBatchCache( 'stats' );
+assert(stats.misses == 2, 'Two blobs that differ only in alpha should miss the cache twice.');
+
+simBatch( optsAlpha, targPos, startPos );
+stats = simBatchCache( 'stats' );
+assert(stats.hits == 1, 'Repeating the second call should hit the cache.');
+rmdir(opts.cache.dir, 's');
@@ -0,0 +1,80 @@
+function [ latency, simStepTime, kalmanStepTime ] = benchmarkSimStep( opts, nSteps, nFeatures )
+    %[latency, simStepTime, kalmanStepTime] = benchmarkSimStep( opts, nSteps, nFeatures ) measures the 
+    %per-step latency of the single-step closed-loop interface (simBci 'reset' / 'step'), as seen from
+    %MATLAB. Returns the latency of each step in microseconds, and the average time
+    %a step takes inside the simulator (simBci 'stepTiming', also in microseconds, timed with a 
+    %monotonic wall clock whose resolution is printed with it),
+    %and prints a summary. kalmanStepTime is the time a step takes inside the simulator 
+    %with the same options but a steady-state Kalman filter plant (decoderType 1) with 
+    %nFeatures neural features (default 192), which includes generating and decoding the features.
+    %
+    %opts is a simulation options struct (makeBciSimOptions defines the
+    %default values and fields). If omitted, the defaults are used with a
+    %1 ms time step and a 200 ms feedback delay, as for a 1 kHz real-time loop.
+    %
+    %nSteps is the number of steps to time (default 100000).
+    %
+    %Usage of the single-step interface:
+    %   simBci(opts, 'init');
+    %   c = simBci(resetOpts, 'reset');          %resetOpts has targetPos, initX, initC and targRad, as for 'run'
+    %   [c, x, acquired] = simBci(u, 'step');    %u = decoded input for the previous control vector c
+    %   [c, x, acquired] = simBci(n, 'stepNoise'); %or let the simulator decode c with noise n
+    %
+    %The difference between the two is the MATLAB-to-mex call overhead,
+    %including the creation of the output arrays of each 'step' call.
+    
+    checkSimBciVersion();
+    
+    if nargin<1 || isempty(opts)
+        opts = makeBciSimOptions( );
+        opts.loopTime = 0.001;
+        opts.forwardModel.delaySteps = 200;
+        opts.forwardModel.forwardSteps = 200;
+        opts.control.rtSteps = 200;
+    end
+    if nargin<2
+        nSteps = 100000;
+    end
+    if nargin<3
+        nFeatures = 192;
+    end
+    
+    simBci(opts, 'init');
+    
+    resetOpts.targetPos = [1 zeros(1,opts.plant.nDim-1)];
+    resetOpts.targRad = opts.trial.targRad;
+    resetOpts.initC = zeros(opts.plant.nDim, opts.forwardModel.delaySteps + 1);
+    resetOpts.initX = zeros(2*opts.plant.nDim, opts.forwardModel.delaySteps + 1);
+    
+    %the decoded input is generated outside the timed loop, as an external decoder would provide it
+    u = randn(opts.plant.nDim, nSteps)*0.5;
+    latency = zeros(nSteps,1);
+    
+    c = simBci(resetOpts, 'reset');
+    for t=1:nSteps
+        stepTimer = tic;
+        c = simBci(c + u(:,t), 'step');
+        latency(t) = toc(stepTimer)*1e6;
+    end
+    
+    %time the same number of steps inside the simulator, from a fresh reset
+    simBci(resetOpts, 'reset');
+    [simStepTime, clockResolution] = simBci(nSteps, 'stepTiming');
+    
+    %the same options with a Kalman filter plant decoding nFeatures neural features
+    kalmanOpts = opts;
+    kalmanOpts.plant.decoderType = 1;
+    kalmanOpts.plant.H = randn(nFeatures, opts.plant.nDim);
+    kalmanOpts.plant.K = pinv(kalmanOpts.plant.H)*0.05;
+    kalmanOpts.plant.A = eye(opts.plant.nDim)*0.95;
+    simBci(kalmanOpts, 'init');
+    simBci(resetOpts, 'reset');
+    kalmanStepTime = simBci(nSteps, 'stepTiming');
+    
+    disp(['Step latency (us): median ' num2str(median(latency),3) ', 99th percentile ' ...
+        num2str(prctile(latency,99),3) ', max ' num2str(max(latency),3)]);
+    disp(['Time per step inside the simulator (us): ' num2str(simStepTime,3) ' (clock resolution ' ...
+        num2str(clockResolution,3) ' us over ' num2str(nSteps) ' steps)']);
+    disp(['Time per step inside the simulator with a ' num2str(nFeatures) '-feature Kalman filter plant (us): ' ...
+        num2str(kalmanStepTime,3)]);
+end
@@ -0,0 +1,76 @@
+function [ relErr, costGrad, fdGrad, paramNames ] = checkSimBatchCostGradient( opts, nTrials, h, tol )
+    %[relErr, costGrad, fdGrad, paramNames] = checkSimBatchCostGradient( opts, nTrials, h, tol ) checks the
+    %cost gradient returned by simBatchCostGradient against central finite differences of the cost, for
+    %alpha, beta, one fTargY knot and one fVelY knot. Raises an error if any relative error is above tol.
+    %
+    %The batch has nTrials movements between alternating targets with a single row of startPos, so each
+    %movement starts where the previous one ended and the tangents carried from one movement to the next
+    %(in simBatch) are checked too. The gradient treats the reaction time period and trial ends as fixed, so
+    %h must be small enough that perturbing a parameter by h does not change when a trial ends.
+    %
+    %opts defaults to makeBciSimOptions() with a fixed noise matrix and a non-zero fVelY, nTrials to 4,
+    %h to 1e-6 and tol to 1e-4. relErr, costGrad and fdGrad have one entry per checked parameter, which
+    %paramNames labels.
+
+    if nargin<1 || isempty(opts)
+        opts = makeBciSimOptions( );
+        opts.control.fVelY = -0.5*linspace(0,1,length(opts.control.fVelX));
+        opts.noiseMatrix = randn(RandStream('twister','Seed',7), 10000, 2);
+    end
+    if nargin<2
+        nTrials = 4;
+    end
+    if nargin<3
+        h = 1e-6;
+    end
+    if nargin<4
+        tol = 1e-4;
+    end
+
+    targPos = repmat([1 0; -0.5 0.3], ceil(nTrials/2), 1);
+    targPos = targPos(1:nTrials,:);
+    startPos = [0 0];
+
+    [~, fullGrad, allNames] = simBatchCostGradient( opts, targPos, startPos );
+
+    %one knot of each control policy function, away from the ends
+    nfTarg = length(opts.control.fTargY);
+    nfVel = length(opts.control.fVelY);
+    fTargKnot = ceil(nfTarg/4);
+    fVelKnot = ceil(nfVel/4);
+    paramIdx = [1; 2; 2+fTargKnot; 2+nfTarg+fVelKnot];
+    paramNames = allNames(paramIdx);
+    costGrad = fullGrad(paramIdx);
+
+    fdGrad = zeros(length(paramIdx),1);
+    for p=1:length(paramIdx)
+        optsPlus = perturb(opts, p, fTargKnot, fVelKnot, h);
+        optsMinus = perturb(opts, p, fTargKnot, fVelKnot, -h);
+        fdGrad(p) = (batchCost(optsPlus, targPos, startPos) - batchCost(optsMinus, targPos, startPos)) / (2*h);
+    end
+
+    relErr = abs(costGrad - fdGrad) ./ max(1, abs(fdGrad));
+    for p=1:length(paramIdx)
+        disp([paramNames{p} ': gradient ' num2str(costGrad(p),8) ', finite difference ' num2str(fdGrad(p),8)]);
+    end
+    if any(relErr > tol)
+        error(['The cost gradient does not match finite differences for ' strjoin(paramNames(relErr > tol)', ', ') '.']);
+    end
+end
+
+function [ opts ] = perturb( opts, p, fTargKnot, fVelKnot, delta )
+    switch p
+        case 1
+            opts.plant.alpha = opts.plant.alpha + delta;
+        case 2
+            opts.plant.beta = opts.plant.beta + delta;
+        case 3
+            opts.control.fTargY(fTargKnot) = opts.control.fTargY(fTargKnot) + delta;
+        case 4
+            opts.control.fVelY(fVelKnot) = opts.control.fVelY(fVelKnot) + delta;
+    end
+end
+
+function [ cost ] = batchCost( opts, targPos, startPos )
+    cost = simBatchCostGradient( opts, targPos, startPos );
+end
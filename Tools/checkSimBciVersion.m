@@ -0,0 +1,33 @@
+function checkSimBciVersion( )
+    %checkSimBciVersion( ) raises an error if the compiled simBci mex file is
+    %older than the MATLAB functions that call it. simBatch and the functions
+    %built on it use simBci subcommands (configuration blobs, 'set', 'runSens',
+    %'step', candidate policies in 'run', ...) that older builds do not have,
+    %and would otherwise fail with an unrelated error. The fix is to recompile
+    %simBci with compileSimBci.m, from the Tools directory.
+    %
+    %The version is the one simBci.c defines as SIMBCI_INTERFACE_VERSION. A
+    %successful check is remembered for the rest of the MATLAB session.
+
+    persistent upToDate;
+    if ~isempty(upToDate)
+        return;
+    end
+
+    try
+        version = simBci([], 'version');
+    catch
+        %builds older than the 'version' subcommand reject it
+        version = 0;
+    end
+
+    if version < requiredVersion()
+        error('simBci:outOfDate', ['The compiled simBci (%s) is out of date for these MATLAB functions. ' ...
+            'Recompile simBci (Tools/compileSimBci.m) and try again.'], which('simBci'));
+    end
+    upToDate = true;
+end
+
+function [ version ] = requiredVersion( )
+    version = 2;
+end
@@ -1,3 +1,3 @@
 %Compiles the simBci mex function. Make sure you are in the Tools directory
 %when compiling.
-mex simBci.c simulator.c pwl_interp_1d.c
+mex simBci.c simulator.c simulatorSens.c simulatorStep.c pwl_interp_1d.c
\ No newline at end of file
@@ -25,6 +25,17 @@ function [ opts ] = makeBciSimOptions( )
     opts.plant.fStaticX = linspace(0,1,10);
     opts.plant.fStaticY = linspace(0,1,10);
     
+    %Instead of the reduced (alpha, beta) plant, the simulator can run a full
+    %steady-state Kalman filter in the loop (decoderType=1). The user's control vector is
+    %encoded by N neural features (features = H*controlVector + noise) that are
+    %decoded with vel = A*vel + K*(features - H*A*vel). K is D x N, A is D x D and
+    %H is N x D. In this case, noiseMatrix must have N columns (one per
+    %feature), and alpha and beta are ignored.
+    opts.plant.decoderType = 0;
+    opts.plant.K = [];
+    opts.plant.A = [];
+    opts.plant.H = [];
+    
     %Specifies how many dimensions to use (the default is 2 for 2D cursor
     %movements, but in principle the simulator can operate in any number of
     %dimensions). 
@@ -58,5 +69,15 @@ function [ opts ] = makeBciSimOptions( )
     
     %The time step (in seconds).
     opts.loopTime = 0.02;
+    
+    %simBatch results can be memoized on disk by setting cache.dir to a
+    %directory (see simBatchCache). The least recently used results are deleted
+    %when the cache grows beyond cache.maxBytes. If cache.noiseKey is set, it
+    %identifies the noise matrix in the cache key (e.g. 'randn, seed 5') instead
+    %of the noise matrix itself, which saves hashing it on every call. It must then change
+    %whenever the noise does.
+    opts.cache.dir = '';
+    opts.cache.maxBytes = 1e9;
+    opts.cache.noiseKey = '';
 end
 
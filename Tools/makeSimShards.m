@@ -0,0 +1,51 @@
+function makeSimShards( queueDir, jobs, nShards, noiseFcn, noiseSeed )
+    %makeSimShards( queueDir, jobs, nShards, noiseFcn, noiseSeed ) splits a sweep or batch of
+    %simulations into shards and writes them to a file-based work queue, so that 
+    %they can be run by any number of worker processes (runSimShardWorker) on
+    %machines that share queueDir. Results are combined with mergeSimShards.
+    %
+    %queueDir is the queue directory (it is created, and must not already
+    %contain a queue).
+    %
+    %jobs is a struct array with fields opts, targPos and startPos. Each job is one
+    %call to simBatch( opts, targPos, startPos ), e.g. one cell of an alpha/beta sweep.
+    %
+    %nShards is the number of shards to split the jobs into. Each shard holds
+    %a contiguous range of jobs, and is the unit of work a worker claims.
+    %
+    %noiseFcn (optional) is a function handle, noiseMatrix = noiseFcn(opts), that
+    %generates the noise matrix for a job. If given, each job's noise is drawn
+    %after seeding the random number generator with noiseSeed + jobIdx (noiseSeed
+    %defaults to 0), so results do not depend on the number of workers, the
+    %number of shards, or which worker ran which shard. Otherwise each job uses
+    %its own opts.noiseMatrix.
+    
+    if nargin<4
+        noiseFcn = [];
+    end
+    if nargin<5
+        noiseSeed = 0;
+    end
+    
+    if exist(fullfile(queueDir,'spec.mat'),'file')
+        error(['A work queue already exists in ' queueDir]);
+    end
+    
+    nJobs = length(jobs);
+    nShards = min(nShards, nJobs);
+    shardEdges = round(linspace(0, nJobs, nShards+1));
+    
+    subDirs = {'pending','claimed','done','results'};
+    for d=1:length(subDirs)
+        mkdir(fullfile(queueDir, subDirs{d}));
+    end
+    
+    %the spec is written before any shard becomes visible in 'pending', so
+    %workers can always load it
+    save(fullfile(queueDir,'spec.mat'), 'jobs', 'nShards', 'noiseFcn', 'noiseSeed');
+    
+    for s=1:nShards
+        jobIdx = (shardEdges(s)+1):shardEdges(s+1);
+        save(fullfile(queueDir, 'pending', [simShardName(s) '.mat']), 'jobIdx');
+    end
+end
@@ -0,0 +1,22 @@
+function [ out ] = mergeSimShards( queueDir )
+    %out = mergeSimShards( queueDir ) combines the results of a work queue made by
+    %makeSimShards and run by runSimShardWorker.
+    %
+    %out is a cell array with one entry per job, in the order the jobs were
+    %given to makeSimShards, where each entry is the simBatch output struct for
+    %that job. The result does not depend on how many workers ran or in which
+    %order shards were finished. An error is thrown if any shard is unfinished.
+    
+    spec = load(fullfile(queueDir,'spec.mat'));
+    out = cell(length(spec.jobs),1);
+    
+    for s=1:spec.nShards
+        resultFile = fullfile(queueDir, 'results', [simShardName(s) '.mat']);
+        if ~exist(resultFile, 'file')
+            error(['Shard ' num2str(s) ' of ' num2str(spec.nShards) ' has not finished (no results in ' resultFile ').']);
+        end
+        
+        shardResults = load(resultFile);
+        out(shardResults.jobIdx) = shardResults.results;
+    end
+end
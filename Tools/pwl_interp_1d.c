@@ -226,4 +226,59 @@ double pwl_value_1d_scalar ( int nd, double xd[], double yd[], double xi )
     }
   }
   return yi;
+}
+
+/******************************************************************************/
+
+double pwl_value_1d_scalar_sens ( int nd, double xd[], double yd[], double xi,
+  double *dydxi, int *kLow, double *tHigh )
+
+/******************************************************************************/
+/*
+  version of pwl_value_1d_scalar that also returns what is needed to differentiate the result.
+  dydxi is the slope of the interpolant at xi (zero where it is clamped). The result equals
+  (1-tHigh)*yd[kLow] + tHigh*yd[kLow+1], so those are its partial derivatives with respect to the
+  two knot values (yd[kLow+1] is only involved when tHigh>0).
+*/
+{
+  int k;
+  double t;
+  double yi = 0;
+
+  *dydxi = 0;
+  *tHigh = 0;
+
+  if ( nd == 1 )
+  {
+    *kLow = 0;
+    yi = yd[0];
+    return yi;
+  }
+
+  if ( xi <= xd[0] )
+  {
+    *kLow = 0;
+    yi = yd[0];
+  }
+  else if ( xd[nd-1] <= xi )
+  {
+    *kLow = nd-1;
+    yi = yd[nd-1];
+  }
+  else
+  {
+    for ( k = 1; k < nd; k++ )
+    {
+      if ( xd[k-1] <= xi && xi <= xd[k] )
+      {
+        t = ( xi - xd[k-1] ) / ( xd[k] - xd[k-1] );
+        yi = ( 1.0 - t ) * yd[k-1] + t * yd[k];
+        *kLow = k-1;
+        *tHigh = t;
+        *dydxi = ( yd[k] - yd[k-1] ) / ( xd[k] - xd[k-1] );
+        break;
+      }
+    }
+  }
+  return yi;
 }
\ No newline at end of file
@@ -4,5 +4,6 @@
 double *pwl_basis_1d ( int nd, double xd[], int ni, double xi[] );
 double *pwl_value_1d ( int nd, double xd[], double yd[], int ni, double xi[] );
 double pwl_value_1d_scalar ( int nd, double xd[], double yd[], double xi );
+double pwl_value_1d_scalar_sens ( int nd, double xd[], double yd[], double xi, double *dydxi, int *kLow, double *tHigh );
 
 #endif
\ No newline at end of file
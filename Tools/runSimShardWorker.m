@@ -0,0 +1,119 @@
+function [ nShardsRun ] = runSimShardWorker( queueDir, staleTime )
+    %nShardsRun = runSimShardWorker( queueDir, staleTime ) claims and runs shards from a work
+    %queue made by makeSimShards until none are left, and returns the number of shards
+    %it ran. Any number of workers can run at once, on one or several machines
+    %that share queueDir, e.g. from a shell:
+    %   matlab -batch "runSimShardWorker('/shared/myQueue')" &
+    %
+    %Shards are claimed without locks: a worker claims a shard by renaming its
+    %file from 'pending' to 'claimed', and renaming is atomic, so exactly one
+    %worker succeeds. Results are written to a temporary file and renamed into
+    %'results', so a partially written result is never visible.
+    %
+    %staleTime (optional, in seconds) lets this worker re-claim shards that
+    %another worker claimed more than staleTime seconds ago without finishing
+    %(e.g. because it crashed). By default, claimed shards are never re-claimed.
+    %The claim time (UTC, in seconds) is part of the claimed file's name, so staleness 
+    %is measured from the latest claim, and the clocks of the machines sharing 
+    %queueDir should agree to well within staleTime. staleTime should be well above 
+    %the time a shard takes to run, or live shards are re-claimed and run twice.
+    
+    if nargin<2
+        staleTime = inf;
+    end
+    
+    [~, hostName] = system('hostname');
+    workerId = sprintf('%s_%d', strtrim(hostName), feature('getpid'));
+    
+    spec = load(fullfile(queueDir,'spec.mat'));
+    nShardsRun = 0;
+    
+    while true
+        [claimedFile, shard] = claimShard(queueDir, workerId, staleTime);
+        if isempty(claimedFile)
+            break;
+        end
+        
+        [~, claimedName] = fileparts(claimedFile);
+        shardName = claimedName(1:length(simShardName(1)));
+        
+        results = cell(length(shard.jobIdx),1);
+        for j=1:length(shard.jobIdx)
+            job = spec.jobs(shard.jobIdx(j));
+            if ~isempty(spec.noiseFcn)
+                rng(spec.noiseSeed + shard.jobIdx(j), 'twister');
+                job.opts.noiseMatrix = spec.noiseFcn(job.opts);
+            end
+            results{j} = simBatch( job.opts, job.targPos, job.startPos );
+        end
+        
+        %publish the results atomically, then mark the shard as done. If a stale claim was re-claimed by another 
+        %worker, both write identical results, so whichever rename lands last is fine.
+        jobIdx = shard.jobIdx;
+        tmpFile = fullfile(queueDir, 'results', ['tmp_' workerId '_' shardName '.mat']);
+        save(tmpFile, 'jobIdx', 'results');
+        movefile(tmpFile, fullfile(queueDir, 'results', [shardName '.mat']), 'f');
+        [~, ~] = movefile(claimedFile, fullfile(queueDir, 'done', [shardName '.mat']), 'f');
+        
+        nShardsRun = nShardsRun + 1;
+    end
+end
+
+function [ claimedFile, shard ] = claimShard( queueDir, workerId, staleTime )
+    %Tries to claim a pending shard (or, failing that, a stale claimed shard). Returns the
+    %path of the claimed file and its contents, or [] if there is nothing left to claim.
+    %Claimed files are named <shard name>_<claim time>_<worker id>.mat.
+    claimedFile = [];
+    shard = [];
+    nameLen = length(simShardName(1));
+    
+    pending = dir(fullfile(queueDir, 'pending', [simShardName() '.mat']));
+    %workers start at different shards so they rarely race for the same one
+    order = circshift(1:length(pending), [0, -mod(feature('getpid'), max(length(pending),1))]);
+    for p=order
+        [claimedFile, shard] = tryClaim(fullfile(queueDir, 'pending', pending(p).name), ...
+            queueDir, pending(p).name(1:nameLen), workerId);
+        if ~isempty(claimedFile)
+            return;
+        end
+    end
+    
+    if isinf(staleTime)
+        return;
+    end
+    
+    claimed = dir(fullfile(queueDir, 'claimed', [simShardName() '.mat']));
+    for p=1:length(claimed)
+        claimTime = sscanf(claimed(p).name((nameLen+2):end), '%d', 1);
+        if ~isempty(claimTime) && utcSeconds() - claimTime > staleTime
+            [claimedFile, shard] = tryClaim(fullfile(queueDir, 'claimed', claimed(p).name), ...
+                queueDir, claimed(p).name(1:nameLen), workerId);
+            if ~isempty(claimedFile)
+                return;
+            end
+        end
+    end
+end
+
+function [ claimedFile, shard ] = tryClaim( sourceFile, queueDir, shardName, workerId )
+    %claims sourceFile by renaming it to a claimed file with the current time, and loads it. Returns [] if another
+    %worker renamed it first, or if another worker re-claims it before it is loaded (then the shard is theirs).
+    claimedFile = [];
+    shard = [];
+    dest = fullfile(queueDir, 'claimed', sprintf('%s_%d_%s.mat', shardName, utcSeconds(), workerId));
+    [ok, ~] = movefile(sourceFile, dest);
+    if ~ok
+        return;
+    end
+    try
+        shard = load(dest);
+        claimedFile = dest;
+    catch
+        shard = [];
+    end
+end
+
+function [ t ] = utcSeconds( )
+    %the current time in whole seconds since 1970 (UTC), the same on every machine sharing a queue
+    t = floor(posixtime(datetime('now', 'TimeZone', 'UTC')));
+end
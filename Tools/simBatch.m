@@ -1,4 +1,4 @@
-function [ out ] = simBatch( opts, targPos, startPos )
+function [ out, cost, costGrad ] = simBatch( opts, targPos, startPos, policies )
     %out = simBatch( opts, targPos, startPos ) simulates a batch of movements
     %and returns the trajectories in a struct.
     %
@@ -14,113 +14,233 @@ function [ out ] = simBatch( opts, targPos, startPos )
     %row vector. If startPos is a single row, then each movement will begin
     %at the end point of the previous one. If startPos has as many rows as targPos, the
     %cursor will be reset to startPos for every trial.
+    %
+    %out = simBatch( opts, targPos, startPos, policies ) simulates the same batch
+    %for several candidate control policies at once, and returns a cell array where
+    %out{k} is the same as simBatch(opts, targPos, startPos) with opts.control
+    %updated by policies(k). policies is a struct array with fields fVelX and fVelY
+    %and/or fTargX and fTargY. The simulator is initialized once for the batch, and each
+    %movement is simulated with one simBci 'run' call per policy, which takes the candidate 
+    %policy with the run options, so opts is not checked again for every policy.
+    %
+    %opts can have a configBlob field, made by blob = simBci(opts,'init') and updated with 
+    %blob = simBci(struct of changed parameters,'set'). Loading it is much faster than checking opts again. 
+    %The configuration in the blob is then used instead of opts.trial (except targRad), opts.forwardModel, 
+    %opts.plant, opts.control and opts.loopTime; opts still supplies the noise matrix, cache and target radius.
+    %
+    %[out, cost, costGrad] = simBatch( opts, targPos, startPos ) also returns the
+    %total trial cost and its gradient with respect to the plant and control policy
+    %parameters (see simBatchCostGradient).
+    %
+    %If opts.cache.dir is set, results are memoized on disk in that directory, and a
+    %call with the same options, targets, start positions, noise and policies
+    %returns the stored result instead of simulating. See simBatchCache and
+    %makeBciSimOptions.
+    
+    checkSimBciVersion();
     
     nTrials = size(targPos,1);
     resetCursor = size(startPos,1)==size(targPos,1);
     
+    usePolicies = nargin>=4;
+    if usePolicies
+        nPolicies = length(policies);
+    else
+        nPolicies = 1;
+        policies = [];
+    end
+    
+    computeGrad = nargout>1;
+    if computeGrad
+        if usePolicies
+            error('The cost gradient can only be computed without policies.');
+        end
+    end
+    
+    %return the stored result if this batch was simulated before
+    useCache = isfield(opts,'cache') && ~isempty(opts.cache.dir) && nTrials>0 && nargout<2 && simBatchCache('available');
+    if useCache
+        cacheKey = simBatchCache('key', opts, targPos, startPos, policies);
+        outs = simBatchCache('load', opts.cache.dir, cacheKey);
+        if ~isempty(outs)
+            if usePolicies
+                out = outs;
+            else
+                out = outs{1};
+            end
+            return;
+        end
+    end
+    
+    %initialize variables that won't change from movement to movement. If opts has a configBlob field (returned by 
+    %simBci 'init' or 'set'), the simulator is reloaded from it instead of checking opts again, and the settings
+    %used below are read back from the simulator so that they match the blob.
+    if isfield(opts, 'configBlob')
+        settings = simBci(opts.configBlob, 'init');
+        opts.loopTime = settings.loopTime;
+        opts.trial.maxTrialTime = settings.maxTrialTime;
+        opts.forwardModel.delaySteps = settings.delaySteps;
+        opts.plant.nDim = settings.nDim;
+        nPolicyParams = settings.nfTarg + settings.nfVel;
+    else
+        simBci(opts, 'init');
+        nPolicyParams = length(opts.control.fTargY) + length(opts.control.fVelY);
+    end
+    if computeGrad
+        cost = 0;
+        costGrad = zeros(2 + nPolicyParams, 1);
+    end
+    
     %information stored reach-wise
-    out.movTime = zeros(nTrials,1);
-    out.reachEpochs = zeros(nTrials, 2);
+    emptyOut.movTime = zeros(nTrials,1);
+    emptyOut.reachEpochs = zeros(nTrials, 2);
     
     %information stored loop-wise
     maxLoopsPerTrial = 1+ceil(opts.trial.maxTrialTime/opts.loopTime);
     maxLoops = maxLoopsPerTrial * nTrials;
-    globalLoopIdx = 1;
-    out.pos = zeros(maxLoops, opts.plant.nDim);
-    out.vel = zeros(maxLoops, opts.plant.nDim);
-    out.posHat = zeros(maxLoops, opts.plant.nDim);
-    out.velHat = zeros(maxLoops, opts.plant.nDim);
-    out.targPos = zeros(maxLoops, opts.plant.nDim);
-    out.controlVec = zeros(maxLoops, opts.plant.nDim);
-    out.decVec = zeros(maxLoops, opts.plant.nDim);
-    
-    %initialize variables that won't change from movement to movement
-    simBci(opts, 'init');
-    
-    %prepare runOpts struct that will change from movement to movement
+    emptyOut.pos = zeros(maxLoops, opts.plant.nDim);
+    emptyOut.vel = zeros(maxLoops, opts.plant.nDim);
+    emptyOut.posHat = zeros(maxLoops, opts.plant.nDim);
+    emptyOut.velHat = zeros(maxLoops, opts.plant.nDim);
+    emptyOut.targPos = zeros(maxLoops, opts.plant.nDim);
+    emptyOut.controlVec = zeros(maxLoops, opts.plant.nDim);
+    emptyOut.decVec = zeros(maxLoops, opts.plant.nDim);
+    outs = repmat({emptyOut}, nPolicies, 1);
+    globalLoopIdx = ones(nPolicies, 1);
+    
+    %prepare runOpts struct that will change from movement to movement (one per policy)
     runOpts.noiseMatrix = opts.noiseMatrix';
     runOpts.noiseIdx = 1;
     runOpts.initC = zeros(opts.plant.nDim, opts.forwardModel.delaySteps + 1);
     runOpts.initX = zeros(2*opts.plant.nDim, opts.forwardModel.delaySteps + 1);
     runOpts.initX(1:opts.plant.nDim,end) = startPos(1,:);
     runOpts.targRad = opts.trial.targRad;
+    runOpts.targetPos = targPos(1,:);
+    runOpts = repmat(runOpts, nPolicies, 1);
     
     %simulate one reach at a time, and record movement data and basic
     %performance metrics
     for r=1:nTrials
-        runOpts.targetPos = targPos(r,:);
-        if resetCursor
-            %initialize forward model history to zero if the cursor gets
-            %reset
-            runOpts.initC = zeros(opts.plant.nDim, opts.forwardModel.delaySteps + 1);
-            runOpts.initX = zeros(2*opts.plant.nDim, opts.forwardModel.delaySteps + 1);
-            
-            %reset cursor position
-            runOpts.initX(1:opts.plant.nDim,end) = startPos(r,:);
-        end
-        
-        %simulate the movement
-        [xMatrix, xHatMatrix, uMatrix, cMatrix, simLoopIdx] = simBci(runOpts, 'run');
-        xMatrix = xMatrix';
-        xHatMatrix = xHatMatrix';
-        uMatrix = uMatrix';
-        cMatrix = cMatrix';
-        
-        %number of loops the movement lasted
-        nLoops = simLoopIdx - opts.forwardModel.delaySteps;
-        
-        %advance the noise index forward so the next movement has different
-        %noise
-        runOpts.noiseIdx = runOpts.noiseIdx + nLoops;
-        if runOpts.noiseIdx > size(runOpts.noiseMatrix,2)
-            runOpts.noiseIdx = 1;
-        end
-
-        %store information from this movement
-        out.movTime(r) = nLoops * opts.loopTime;
+        for k=1:nPolicies
+            runOpts(k).targetPos = targPos(r,:);
+            if resetCursor
+                %initialize forward model history to zero if the cursor gets
+                %reset
+                runOpts(k).initC = zeros(opts.plant.nDim, opts.forwardModel.delaySteps + 1);
+                runOpts(k).initX = zeros(2*opts.plant.nDim, opts.forwardModel.delaySteps + 1);
 
-        if ~resetCursor && r>1
-            loopIdxToUse = (opts.forwardModel.delaySteps+2):simLoopIdx;
-        else
-            loopIdxToUse = (opts.forwardModel.delaySteps+1):simLoopIdx;
+                %reset cursor position
+                runOpts(k).initX(1:opts.plant.nDim,end) = startPos(r,:);
+            end
         end
-        nLoops = length(loopIdxToUse);
-        entryIdx = globalLoopIdx:(globalLoopIdx+nLoops-1);
         
-        pos = xMatrix(loopIdxToUse,1:opts.plant.nDim);
-        out.pos(entryIdx,:) = pos;
-        out.vel(entryIdx,:) = xMatrix(loopIdxToUse,(opts.plant.nDim+1):(2*opts.plant.nDim));
-        out.posHat(entryIdx,:) = xHatMatrix(loopIdxToUse,1:opts.plant.nDim);
-        out.velHat(entryIdx,:) = xHatMatrix(loopIdxToUse,(opts.plant.nDim+1):(2*opts.plant.nDim));
-        out.targPos(entryIdx,:) = repmat(runOpts.targetPos,length(loopIdxToUse),1);
-        out.controlVec(entryIdx,:) = cMatrix(loopIdxToUse,:);
-        out.decVec(entryIdx,:) = uMatrix(loopIdxToUse,:);
-        out.reachEpochs(r,:) = [globalLoopIdx, globalLoopIdx + nLoops - 1];
-        
-        globalLoopIdx = globalLoopIdx + nLoops;
- 
-        %prepare to start the next movement with the final state of this movement
-        if ~resetCursor
-            lastIdx = globalLoopIdx - 1;
-            tmpIdx = (lastIdx-opts.forwardModel.delaySteps):lastIdx;
-            negativeIdx = tmpIdx<1;
-            if sum(negativeIdx)>0
-                runOpts.initC = [zeros(size(cMatrix,2),sum(negativeIdx)), out.controlVec(tmpIdx(~negativeIdx),:)'];
-                runOpts.initX = [zeros(size(xMatrix,2),sum(negativeIdx)), [out.pos(tmpIdx(~negativeIdx),:), out.vel(tmpIdx(~negativeIdx),:)]'];               
-            else
-                runOpts.initC = out.controlVec(tmpIdx,:)';
-                runOpts.initX = [out.pos(tmpIdx,:), out.vel(tmpIdx,:)]';
+        if computeGrad
+            %simulate the movement together with the tangents of its state with respect to the parameters
+            [xMatrix, xHatMatrix, uMatrix, cMatrix, simLoopIdx, trialCost, trialCostGrad, dxMatrix, dcMatrix] = simBci(runOpts, 'runSens');
+            cost = cost + trialCost;
+            costGrad = costGrad + trialCostGrad;
+            
+            %if the next movement starts from the final state of this one, that state's tangents carry over too
+            if ~resetCursor
+                tmpIdx = (simLoopIdx-opts.forwardModel.delaySteps):simLoopIdx;
+                runOpts.initDx = dxMatrix(:,tmpIdx);
+                runOpts.initDc = dcMatrix(:,tmpIdx);
+            end
+            [outs{1}, runOpts, globalLoopIdx] = storeMovement(outs{1}, runOpts, globalLoopIdx, r, ...
+                xMatrix, xHatMatrix, uMatrix, cMatrix, simLoopIdx, opts, resetCursor);
+        elseif ~usePolicies
+            %simulate the movement
+            [xMatrix, xHatMatrix, uMatrix, cMatrix, simLoopIdx] = simBci(runOpts, 'run');
+            [outs{1}, runOpts, globalLoopIdx] = storeMovement(outs{1}, runOpts, globalLoopIdx, r, ...
+                xMatrix, xHatMatrix, uMatrix, cMatrix, simLoopIdx, opts, resetCursor);
+        else
+            %simulate the movement with each candidate policy, which 'run' uses for this movement only
+            policyFields = fieldnames(policies);
+            for k=1:nPolicies
+                candidateOpts = runOpts(k);
+                for f=1:length(policyFields)
+                    candidateOpts.(policyFields{f}) = policies(k).(policyFields{f});
+                end
+                [xMatrix, xHatMatrix, uMatrix, cMatrix, simLoopIdx] = simBci(candidateOpts, 'run');
+                [outs{k}, runOpts(k), globalLoopIdx(k)] = storeMovement(outs{k}, runOpts(k), globalLoopIdx(k), r, ...
+                    xMatrix, xHatMatrix, uMatrix, cMatrix, simLoopIdx, opts, resetCursor);
             end
         end
     end
     
-    keepIdx = 1:(globalLoopIdx-1);
-    out.pos = out.pos(keepIdx,:);
-    out.vel = out.vel(keepIdx,:);
-    out.posHat = out.posHat(keepIdx,:);
-    out.velHat = out.velHat(keepIdx,:);
-    out.targPos = out.targPos(keepIdx,:);
-    out.controlVec = out.controlVec(keepIdx,:);
-    out.decVec = out.decVec(keepIdx,:);
+    for k=1:nPolicies
+        keepIdx = 1:(globalLoopIdx(k)-1);
+        outs{k}.pos = outs{k}.pos(keepIdx,:);
+        outs{k}.vel = outs{k}.vel(keepIdx,:);
+        outs{k}.posHat = outs{k}.posHat(keepIdx,:);
+        outs{k}.velHat = outs{k}.velHat(keepIdx,:);
+        outs{k}.targPos = outs{k}.targPos(keepIdx,:);
+        outs{k}.controlVec = outs{k}.controlVec(keepIdx,:);
+        outs{k}.decVec = outs{k}.decVec(keepIdx,:);
+    end
+    
+    if useCache
+        simBatchCache('save', opts.cache.dir, cacheKey, outs, opts.cache.maxBytes);
+    end
+    
+    if usePolicies
+        out = outs;
+    else
+        out = outs{1};
+    end
 end
 
+function [ out, runOpts, globalLoopIdx ] = storeMovement( out, runOpts, globalLoopIdx, r, xMatrix, xHatMatrix, uMatrix, cMatrix, simLoopIdx, opts, resetCursor )
+    %records a simulated movement in the output struct, and prepares runOpts for the next movement
+    xMatrix = xMatrix';
+    xHatMatrix = xHatMatrix';
+    uMatrix = uMatrix';
+    cMatrix = cMatrix';
+    
+    %number of loops the movement lasted
+    nLoops = simLoopIdx - opts.forwardModel.delaySteps;
+    
+    %advance the noise index forward so the next movement has different
+    %noise
+    runOpts.noiseIdx = runOpts.noiseIdx + nLoops;
+    if runOpts.noiseIdx > size(runOpts.noiseMatrix,2)
+        runOpts.noiseIdx = 1;
+    end
+
+    %store information from this movement
+    out.movTime(r) = nLoops * opts.loopTime;
+
+    if ~resetCursor && r>1
+        loopIdxToUse = (opts.forwardModel.delaySteps+2):simLoopIdx;
+    else
+        loopIdxToUse = (opts.forwardModel.delaySteps+1):simLoopIdx;
+    end
+    nLoops = length(loopIdxToUse);
+    entryIdx = globalLoopIdx:(globalLoopIdx+nLoops-1);
+    
+    pos = xMatrix(loopIdxToUse,1:opts.plant.nDim);
+    out.pos(entryIdx,:) = pos;
+    out.vel(entryIdx,:) = xMatrix(loopIdxToUse,(opts.plant.nDim+1):(2*opts.plant.nDim));
+    out.posHat(entryIdx,:) = xHatMatrix(loopIdxToUse,1:opts.plant.nDim);
+    out.velHat(entryIdx,:) = xHatMatrix(loopIdxToUse,(opts.plant.nDim+1):(2*opts.plant.nDim));
+    out.targPos(entryIdx,:) = repmat(runOpts.targetPos,length(loopIdxToUse),1);
+    out.controlVec(entryIdx,:) = cMatrix(loopIdxToUse,:);
+    out.decVec(entryIdx,:) = uMatrix(loopIdxToUse,:);
+    out.reachEpochs(r,:) = [globalLoopIdx, globalLoopIdx + nLoops - 1];
+    
+    globalLoopIdx = globalLoopIdx + nLoops;
+
+    %prepare to start the next movement with the final state of this movement
+    if ~resetCursor
+        lastIdx = globalLoopIdx - 1;
+        tmpIdx = (lastIdx-opts.forwardModel.delaySteps):lastIdx;
+        negativeIdx = tmpIdx<1;
+        if sum(negativeIdx)>0
+            runOpts.initC = [zeros(size(cMatrix,2),sum(negativeIdx)), out.controlVec(tmpIdx(~negativeIdx),:)'];
+            runOpts.initX = [zeros(size(xMatrix,2),sum(negativeIdx)), [out.pos(tmpIdx(~negativeIdx),:), out.vel(tmpIdx(~negativeIdx),:)]'];               
+        else
+            runOpts.initC = out.controlVec(tmpIdx,:)';
+            runOpts.initX = [out.pos(tmpIdx,:), out.vel(tmpIdx,:)]';
+        end
+    end
+end
@@ -0,0 +1,301 @@
+function [ varargout ] = simBatchCache( command, varargin )
+    %simBatchCache implements the on-disk cache of simBatch results that is
+    %used when opts.cache.dir is set (see makeBciSimOptions). Each result is
+    %stored in its own file in the cache directory, named after a hash of
+    %everything the result depends on, so any number of processes can share one
+    %cache directory.
+    %
+    %key = simBatchCache( 'key', opts, targPos, startPos, policies ) returns the
+    %cache key (a SHA-256 hex string) of a simBatch call. The key is a hash of a
+    %canonical serialization of opts (field order and numeric class do not
+    %matter, opts.cache is left out), targPos, startPos, policies and the simBci
+    %mex file's date and size, so results are not reused after the simulator is
+    %recompiled. opts.configBlob is hashed as raw bytes: simBatch simulates the
+    %configuration in the blob, and equal configurations give identical blobs
+    %(see simBci 'init'), so blobs made with 'set' for different parameters get
+    %different keys. If opts.cache.noiseKey is not empty, it
+    %identifies the noise (e.g. 'randn, seed 5') instead of the contents of
+    %opts.noiseMatrix, which saves hashing a large noise matrix.
+    %
+    %outs = simBatchCache( 'load', cacheDir, key ) returns a cell array with the
+    %cached simBatch output(s) for key, or [] if key is not in the cache. The
+    %file is read through memmapfile, whose Data property copies each record
+    %into ordinary MATLAB arrays (simBatch returns ordinary arrays), so a hit
+    %costs one copy of the result. A hit marks the entry as recently used.
+    %
+    %simBatchCache( 'save', cacheDir, key, outs, maxBytes ) stores a cell array
+    %of simBatch outputs under key, then deletes the least recently used
+    %entries until the cache holds at most maxBytes bytes. Temporary files left
+    %behind by writers that were killed before renaming them into place are
+    %deleted once they are older than a few minutes.
+    %
+    %available = simBatchCache( 'available' ) returns whether the cache can be
+    %used in this MATLAB session. Keys are hashed with Java's MessageDigest, so
+    %the cache needs the Java VM. In -nojvm sessions, which are common for batch
+    %and cluster workers, it returns false and warns once, and simBatch then
+    %simulates without the cache.
+    %
+    %stats = simBatchCache( 'stats' ) returns the number of hits, misses, saves
+    %and evictions in this MATLAB session, and simBatchCache( 'resetStats' )
+    %sets them to zero.
+    %
+    %File format (native byte order): a header of uint32 values [magic, version,
+    %nOut, nTrials(1), nLoops(1), nDim(1), ..., nTrials(nOut), nLoops(nOut),
+    %nDim(nOut)], padded to a multiple of 8 bytes, followed by each output's
+    %movTime, reachEpochs, pos, vel, posHat, velHat, targPos, controlVec and
+    %decVec as column-major doubles.
+
+    persistent stats;
+    persistent warnedNoJvm;
+    if isempty(stats)
+        stats = struct('hits',0,'misses',0,'saves',0,'evictions',0);
+    end
+
+    switch command
+        case 'key'
+            varargout{1} = cacheKey(varargin{:});
+        case 'load'
+            varargout{1} = loadEntry(varargin{:});
+            if isempty(varargout{1})
+                stats.misses = stats.misses + 1;
+            else
+                stats.hits = stats.hits + 1;
+            end
+        case 'save'
+            nEvicted = saveEntry(varargin{:});
+            stats.saves = stats.saves + 1;
+            stats.evictions = stats.evictions + nEvicted;
+        case 'available'
+            varargout{1} = usejava('jvm');
+            if ~varargout{1} && isempty(warnedNoJvm)
+                warning('simBatchCache:noJvm', ['The simBatch cache needs the Java VM, which this session was ' ...
+                    'started without (-nojvm), so opts.cache.dir is ignored.']);
+                warnedNoJvm = true;
+            end
+        case 'stats'
+            varargout{1} = stats;
+        case 'resetStats'
+            stats = struct('hits',0,'misses',0,'saves',0,'evictions',0);
+        otherwise
+            error('The first input must equal ''key'', ''load'', ''save'', ''available'', ''stats'' or ''resetStats''.');
+    end
+end
+
+function [ key ] = cacheKey( opts, targPos, startPos, policies )
+    %hashes everything a simBatch result depends on
+    md = java.security.MessageDigest.getInstance('SHA-256');
+    md.update(uint8(sprintf('simBatchCache v%d', cacheVersion())));
+
+    mexFile = dir(which('simBci'));
+    if ~isempty(mexFile)
+        md.update(uint8(sprintf('%s %.10f %d', mexFile(1).name, mexFile(1).datenum, mexFile(1).bytes)));
+    end
+
+    noiseKey = '';
+    if isfield(opts, 'cache')
+        if isfield(opts.cache, 'noiseKey')
+            noiseKey = opts.cache.noiseKey;
+        end
+        opts = rmfield(opts, 'cache');
+    end
+    if ~isempty(noiseKey)
+        opts.noiseMatrix = ['noiseKey: ' noiseKey];
+    end
+
+    hashValue(md, opts);
+    hashValue(md, targPos);
+    hashValue(md, startPos);
+    hashValue(md, policies);
+
+    key = sprintf('%02x', typecast(md.digest(), 'uint8'));
+end
+
+function hashValue( md, v )
+    %feeds a canonical serialization of v (its kind, size and contents) to the message digest md. Numeric and logical
+    %values are converted to double, since the simulator reads them all as doubles, and struct fields are visited in
+    %sorted order.
+    md.update(uint8(sprintf('|%s', sprintf('%d ', size(v)))));
+    if isstruct(v)
+        names = sort(fieldnames(v));
+        md.update(uint8(sprintf('struct:%s', sprintf('%s,', names{:}))));
+        for e=1:numel(v)
+            for f=1:length(names)
+                hashValue(md, v(e).(names{f}));
+            end
+        end
+    elseif iscell(v)
+        md.update(uint8('cell'));
+        for e=1:numel(v)
+            hashValue(md, v{e});
+        end
+    elseif ischar(v)
+        md.update(uint8('char'));
+        if ~isempty(v)
+            md.update(typecast(uint16(v(:)'), 'uint8'));
+        end
+    elseif isa(v, 'uint8')
+        %configuration blobs, whose bytes are hashed as they are
+        md.update(uint8('uint8'));
+        if ~isempty(v)
+            md.update(v(:)');
+        end
+    elseif isnumeric(v) || islogical(v)
+        md.update(uint8('double'));
+        if ~isempty(v)
+            md.update(typecast(double(v(:)'), 'uint8'));
+        end
+    elseif isa(v, 'function_handle')
+        md.update(uint8(['function:' func2str(v)]));
+    else
+        error(['Cannot make a cache key from a value of class ' class(v)]);
+    end
+end
+
+function [ outs ] = loadEntry( cacheDir, key )
+    %maps a cache file and copies its arrays into simBatch output structs (reading m.Data makes the copy)
+    outs = [];
+    fileName = fullfile(cacheDir, [key '.simres']);
+    fileInfo = dir(fileName);
+    if isempty(fileInfo)
+        return;
+    end
+
+    try
+        header = memmapfile(fileName, 'Format', 'uint32', 'Repeat', 3);
+        header = double(header.Data);
+        if header(1)~=cacheMagic() || header(2)~=cacheVersion()
+            error('simBatchCache:badFile', 'Not a cache file of this version');
+        end
+        nOut = header(3);
+
+        header = memmapfile(fileName, 'Format', 'uint32', 'Repeat', 3+3*nOut);
+        dims = reshape(double(header.Data(4:end)), 3, nOut);
+        offset = headerBytes(nOut);
+        if fileInfo.bytes ~= offset + sum(recordBytes(dims))
+            error('simBatchCache:badFile', 'Cache file has the wrong size');
+        end
+
+        outs = cell(nOut,1);
+        for k=1:nOut
+            m = memmapfile(fileName, 'Format', recordFormat(dims(:,k)), 'Offset', offset, 'Repeat', 1);
+            outs{k} = m.Data;
+            offset = offset + recordBytes(dims(:,k));
+        end
+        clear m header;
+    catch err
+        %a file that cannot be read (e.g. one that was evicted by another process meanwhile) is a miss
+        outs = [];
+        if strcmp(err.identifier, 'simBatchCache:badFile')
+            warning(['Deleting invalid cache file ' fileName]);
+            deleteQuietly(fileName);
+        end
+        return;
+    end
+
+    %the file modification time records when an entry was last used
+    file = java.io.File(fileName);
+    file.setLastModified(java.lang.System.currentTimeMillis());
+end
+
+function [ nEvicted ] = saveEntry( cacheDir, key, outs, maxBytes )
+    %writes a cache file atomically (to a temporary file that is then renamed), then evicts least recently used entries
+    if ~exist(cacheDir, 'dir')
+        [~, ~] = mkdir(cacheDir);
+    end
+
+    nOut = length(outs);
+    dims = zeros(3, nOut);
+    for k=1:nOut
+        dims(:,k) = [size(outs{k}.movTime,1); size(outs{k}.pos,1); size(outs{k}.pos,2)];
+    end
+    header = zeros(headerBytes(nOut)/4, 1, 'uint32');
+    header(1:(3+3*nOut)) = [cacheMagic(); cacheVersion(); nOut; dims(:)];
+
+    [~, tmpName] = fileparts(tempname);
+    tmpFile = fullfile(cacheDir, ['tmp_' tmpName]);
+    fid = fopen(tmpFile, 'w');
+    if fid<0
+        error(['Cannot write to cache directory ' cacheDir]);
+    end
+    fwrite(fid, header, 'uint32');
+    fields = recordFields();
+    for k=1:nOut
+        for f=1:length(fields)
+            fwrite(fid, outs{k}.(fields{f}), 'double');
+        end
+    end
+    fclose(fid);
+    movefile(tmpFile, fullfile(cacheDir, [key '.simres']), 'f');
+
+    nEvicted = evict(cacheDir, maxBytes);
+end
+
+function [ nEvicted ] = evict( cacheDir, maxBytes )
+    %deletes the least recently used cache files until the cache holds at most maxBytes bytes, after deleting temporary
+    %files that no writer can still be working on (writing one entry takes seconds at most, so a few minutes is ample)
+    nEvicted = 0;
+    tmpFiles = dir(fullfile(cacheDir, 'tmp_*'));
+    for f=1:length(tmpFiles)
+        if (now - tmpFiles(f).datenum)*24*3600 > orphanAge()
+            deleteQuietly(fullfile(cacheDir, tmpFiles(f).name));
+        end
+    end
+    
+    files = dir(fullfile(cacheDir, '*.simres'));
+    totalBytes = sum([files.bytes]);
+    if totalBytes <= maxBytes
+        return;
+    end
+
+    [~, order] = sort([files.datenum]);
+    for f=order
+        if totalBytes <= maxBytes
+            break;
+        end
+        deleteQuietly(fullfile(cacheDir, files(f).name));
+        totalBytes = totalBytes - files(f).bytes;
+        nEvicted = nEvicted + 1;
+    end
+end
+
+function deleteQuietly( fileName )
+    %another process may have deleted the file already
+    if exist(fileName, 'file')
+        try
+            delete(fileName);
+        catch
+        end
+    end
+end
+
+function [ fields ] = recordFields( )
+    fields = {'movTime','reachEpochs','pos','vel','posHat','velHat','targPos','controlVec','decVec'};
+end
+
+function [ format ] = recordFormat( dims )
+    %memmapfile format of one simBatch output with nTrials, nLoops and nDim given by dims
+    fields = recordFields();
+    sizes = [{[dims(1) 1], [dims(1) 2]}, repmat({[dims(2) dims(3)]}, 1, 7)];
+    format = [repmat({'double'}, length(fields), 1), sizes', fields'];
+end
+
+function [ nBytes ] = recordBytes( dims )
+    nBytes = 8*(3*dims(1,:) + 7*dims(2,:).*dims(3,:));
+end
+
+function [ nBytes ] = headerBytes( nOut )
+    nBytes = 8*ceil((3+3*nOut)/2);
+end
+
+function [ seconds ] = orphanAge( )
+    %age (in seconds) after which a temporary file is assumed to be left by a killed writer
+    seconds = 300;
+end
+
+function [ magic ] = cacheMagic( )
+    magic = double(typecast(uint8('SBRC'), 'uint32'));
+end
+
+function [ version ] = cacheVersion( )
+    version = 1;
+end
@@ -0,0 +1,34 @@
+function [ cost, costGrad, paramNames ] = simBatchCostGradient( opts, targPos, startPos )
+    %[cost, costGrad, paramNames] = simBatchCostGradient( opts, targPos, startPos ) simulates a batch
+    %of movements like simBatch, and returns the total trial cost together with its gradient with respect to
+    %the plant and control policy parameters.
+    %
+    %The cost of a movement is the time integral of the cursor's distance to
+    %the target (in distance*seconds), and cost is the sum over all movements. The gradient
+    %is computed with forward-mode differentiation inside the simulator (simBci 'runSens'), 
+    %so one batch replaces the 2*P finite-difference batches that would otherwise be needed.
+    %
+    %costGrad is a P x 1 vector ordered as [alpha; beta; fTargY(:); fVelY(:)], and paramNames
+    %labels each entry. The gradient is that of the trajectories actually taken:
+    %the reaction time period, target deadzone and trial end are treated as fixed.
+    %If startPos is a single row, each movement starts where the previous one ended, and the
+    %gradient includes the effect of the parameters on that start state.
+    %
+    %opts, targPos and startPos are the same as for simBatch, which does the simulation.
+    
+    checkSimBciVersion();
+    if isfield(opts, 'configBlob')
+        %the number of policy parameters is read from the blob, which overrides opts.control
+        settings = simBci(opts.configBlob, 'init');
+        nfTarg = settings.nfTarg;
+        nfVel = settings.nfVel;
+    else
+        nfTarg = length(opts.control.fTargY);
+        nfVel = length(opts.control.fVelY);
+    end
+    paramNames = [{'alpha'; 'beta'}; ...
+        arrayfun(@(x)sprintf('fTargY(%d)',x), (1:nfTarg)', 'UniformOutput', false); ...
+        arrayfun(@(x)sprintf('fVelY(%d)',x), (1:nfVel)', 'UniformOutput', false)];
+    
+    [~, cost, costGrad] = simBatch( opts, targPos, startPos );
+end
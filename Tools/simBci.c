@@ -1,9 +1,20 @@
 //This function is for input checking and initializing the simulator.
 //The actual simulation is done by simulator.c
 
+//clock_gettime is POSIX, and is not declared in strict C modes unless this is defined
+#if defined(__linux__) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <time.h>
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <mach/mach_time.h>
+#endif
 #include "mex.h"
 #include "simulator.h"
 #include "pwl_interp_1d.h"
@@ -11,12 +22,66 @@
 struct simulator sim;
 int initialized = 0;
 
+//Version of the subcommands and their inputs and outputs, returned by 'version'. The MATLAB functions that call simBci 
+//check it (checkSimBciVersion.m), so a compiled simBci that is older than them gives a clear error. Increment it 
+//whenever a subcommand is added or changed.
+#define SIMBCI_INTERFACE_VERSION 2
+
+//state for the single-step interface ('reset' and 'step')
+struct simStepState stepState;
+int stepReady = 0;
+
+//snapshot of a movement prefix for 'runPrefix' and 'fork'
+struct simSnapshot snapshot;
+int snapshotReady = 0;
+int snapshotMaxLoops = 0;
+int snapshotNoiseCols = 0;
+
+//the control policy loaded by 'init' or 'set', which 'run' and 'fork' restore after simulating with a candidate policy
+struct simController loadedControl;
+
+//A configuration blob is a uint8 vector that holds a validated copy of everything 'init' reads from opts, so that a 
+//configuration can be reloaded without parsing and checking opts again. It is a memory image of the simulator structs, 
+//so the header records their sizes and a blob can only be loaded by the same build of simBci. The Kalman filter 
+//matrices (K, A, H and the precomputed kalmanM, kalmanKH and kalmanKt) follow the structs for decoderType 1.
+#define CONFIG_BLOB_VERSION 1
+struct configBlobHeader {
+    char magic[4];
+    int version;
+    int nBytes;
+    int structSizes[5];
+    int nDim;
+    int nFeatures;
+    int decoderType;
+    double loopTime;
+};
+
 //Various input checking and utility functions
 void checkFields(const mxArray *m, char fields [][20] , int numFields, char *structName);
 void checkVectorLen(mxArray *vector, int len, char *errMsg);
 void checkMatRows(mxArray *mat, int rows, char *errMsg);
 void checkMatrixSizeEquality(mxArray *m1, mxArray *m2, char *errMsg);
+int pwlKnots(mxArray *x_src);
+void checkPwlNotEmpty(mxArray *x_src, char *errMsg);
 void copyPwlFunction(double *x, double *y, int *nKnots, mxArray *x_src, mxArray *y_src);
+double *allocPersistentMatrix(int nElements);
+mxArray *stepOutput(double *values, int nElements);
+void setRunOutputs(mxArray *plhs[]);
+void checkNoiseMatrix(mxArray *noiseMatrix);
+int copyControlPolicy(const mxArray *opts);
+void setParameters(const mxArray *opts);
+void allocKalmanPlant(void);
+int configBlobSize(void);
+mxArray *makeConfigBlob(void);
+void loadConfigBlob(const mxArray *blob);
+void checkConfigRanges(void);
+void zeroUnusedKnots(double *x, double *y, int nKnots);
+mxArray *configSettings(void);
+void freePersistentMemory(void);
+int stepSubcommand(const mxArray *funcName);
+void stepCommand(int nlhs, mxArray *plhs[], const mxArray *input, int inputIsDecoded);
+void freeSnapshot(void);
+double monotonicTime(double *resolution);
 
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
@@ -29,6 +94,11 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     char fieldsNoise[][20] = {"sdnX","sdnY"};
     char fieldsControl[][20] = {"fTargX","fTargY","fVelX","fVelY","rtSteps","targetDeadzone"};
     char fieldsRunOpts[][20] = {"noiseMatrix","noiseIdx","targetPos","initC","initX","targRad"}; 
+    char fieldsKalman[][20] = {"K","A","H"};
+    char fieldsResetOpts[][20] = {"targetPos","initC","initX","targRad"}; 
+    char fieldsPrefixOpts[][20] = {"prefixLoops"}; 
+    char fieldsSensOpts[][20] = {"initDx","initDc"}; 
+    char fieldsForkOpts[][20] = {"noiseMatrix"}; 
     
     mxArray *trial;
 	mxArray *plant;
@@ -43,7 +113,17 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     const mxArray *opts;
     
     int nInitRows;
+    int nSteps;
+    int s;
+    double *zeroNoise;
+    double startTime;
+    double clockResolution;
     int maxLoops;
+    int runSens;
+    int runPrefix;
+    int policyChanged;
+    int stepCommandType;
+    double *costGrad;
     int x;
     int y;
     
@@ -52,12 +132,31 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         mexErrMsgTxt("This function takes two input arguments: a struct of data and a string specifying the sub-function to call.");
     } 
     
-    funcString = mxArrayToString(prhs[1]);
     opts = prhs[0];
     
+    //'step' and 'stepNoise' are called at every time step of a real-time loop, so they are recognized from the 
+    //characters of the second input directly, without converting it to a C string and going through the list below
+    stepCommandType = stepSubcommand(prhs[1]);
+    if(stepCommandType!=0)
+    {
+        stepCommand(nlhs, plhs, opts, stepCommandType==1);
+        return;
+    }
+    
+    funcString = mxArrayToString(prhs[1]);
+    
     //The function will 'initialize' or 'run' based on the second input.
     //'initialize' sets struct fields to prepare to run the simulator. 
     //'run' simulates a single movement. 
+    //'runSens' simulates a single movement and also returns the gradient of the trial cost with respect to
+    //alpha, beta, fTargY and fVelY (see simulatorSens.c), and optionally the tangents of the state and control vectors.
+    //'reset', 'step' and 'stepNoise' advance a movement one time step at a time (see simulatorStep.c), and 'stepTiming'
+    //measures how long a step takes.
+    //'runPrefix' simulates the first opts.prefixLoops time steps of a movement and keeps a snapshot of its state. 'fork' 
+    //then completes the movement from that snapshot, optionally with a different control policy, and can be called 
+    //several times per snapshot.
+    //'set' changes individual parameters of an initialized simulator without calling 'init' again.
+    //'version' returns SIMBCI_INTERFACE_VERSION.
     if (funcString==NULL)
     {
         mexErrMsgTxt("Second input must be a string.");
@@ -66,8 +165,27 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     {
         //Populates the simulator struct with all specifications.
         //Does a lot of input checking.
-        if( nlhs != 0)
-            mexErrMsgTxt("When calling 'init', must have zero outputs.");
+        //With one output, also returns a configuration blob of the result. Passing that blob as the first input 
+        //instead of opts reloads the configuration without repeating the checks, and the output is then a struct of 
+        //the settings that callers like simBatch need to know (see configSettings).
+        if( nlhs > 1)
+            mexErrMsgTxt("When calling 'init', must have at most one output.");
+        
+        initialized = 0;
+        stepReady = 0;
+        snapshotReady = 0;
+        freePersistentMemory();
+        
+        if(mxIsUint8(opts))
+        {
+            loadConfigBlob(opts);
+            loadedControl = sim.control;
+            initialized = 1;
+            if(nlhs > 0)
+                plhs[0] = configSettings();
+            mxFree(funcString);
+            return;
+        }
     
         checkFields(opts,fieldsOpts,6,"opts");
         
@@ -105,25 +223,106 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         checkMatrixSizeEquality(mxGetField(control,0,"fTargX"), mxGetField(control,0,"fTargY"), "Dimensions of opts.control.fTargX and opts.control.fTargY should be equal");
         checkMatrixSizeEquality(mxGetField(control,0,"fVelX"), mxGetField(control,0,"fVelY"), "Dimensions of opts.control.fVelX and opts.control.fVelY should be equal");
         checkMatrixSizeEquality(mxGetField(plant,0,"fStaticX"), mxGetField(plant,0,"fStaticY"), "Dimensions of opts.plant.fStaticX and opts.plant.fStaticY should be equal");
+        checkPwlNotEmpty(mxGetField(noise,0,"sdnX"), "opts.noise.sdnX and opts.noise.sdnY should have at least one knot.");
+        checkPwlNotEmpty(mxGetField(control,0,"fTargX"), "opts.control.fTargX and opts.control.fTargY should have at least one knot.");
+        checkPwlNotEmpty(mxGetField(control,0,"fVelX"), "opts.control.fVelX and opts.control.fVelY should have at least one knot.");
                 
         copyPwlFunction(sim.noise.sdnX, sim.noise.sdnY, &sim.noise.nsdn, mxGetField(noise,0,"sdnX"), mxGetField(noise,0,"sdnY"));
         copyPwlFunction(sim.control.fTargX, sim.control.fTargY, &sim.control.nfTarg, mxGetField(control,0,"fTargX"), mxGetField(control,0,"fTargY"));
         copyPwlFunction(sim.control.fVelX, sim.control.fVelY, &sim.control.nfVel, mxGetField(control,0,"fVelX"), mxGetField(control,0,"fVelY"));
         copyPwlFunction(sim.plant.fStaticX, sim.plant.fStaticY, &sim.plant.nfStatic, mxGetField(plant,0,"fStaticX"), mxGetField(plant,0,"fStaticY"));
+        
+        //opts.plant.decoderType is optional so that older options structs still work (they use the (alpha, beta) plant)
+        if(mxGetField(plant,0,"decoderType")==NULL)
+            sim.plant.decoderType = 0;
+        else
+            sim.plant.decoderType = (int)mxGetScalar(mxGetField(plant,0,"decoderType"));
+        
+        sim.plant.nFeatures = 0;
+        if(sim.plant.decoderType==1)
+        {
+            //the sizes are checked here, before anything is allocated from them
+            checkFields(plant,fieldsKalman,3,"plant");
+            sim.plant.nFeatures = (int)mxGetN(mxGetField(plant,0,"K"));
+            
+            if(sim.plant.nDim < 1 || sim.plant.nDim > MAX_DIM)
+                mexErrMsgTxt("opts.plant.nDim should be between 1 and MAX_DIM (100).");
+            if(sim.plant.nFeatures < 1)
+                mexErrMsgTxt("opts.plant.K should have at least one column (one per neural feature).");
+            checkMatRows(mxGetField(plant,0,"K"), sim.plant.nDim, "Number of rows in opts.plant.K should be equal to opts.plant.nDim.");
+            checkMatRows(mxGetField(plant,0,"A"), sim.plant.nDim, "opts.plant.A should be an nDim x nDim matrix.");
+            checkMatRows(mxGetField(plant,0,"H"), sim.plant.nFeatures, "Number of rows in opts.plant.H should be equal to the number of columns in opts.plant.K.");
+            if(mxGetN(mxGetField(plant,0,"A"))!=sim.plant.nDim)
+                mexErrMsgTxt("opts.plant.A should be an nDim x nDim matrix.");
+            if(mxGetN(mxGetField(plant,0,"H"))!=sim.plant.nDim)
+                mexErrMsgTxt("Number of columns in opts.plant.H should be equal to opts.plant.nDim.");
+            
+            allocKalmanPlant();
+            memcpy(sim.plant.K, mxGetPr(mxGetField(plant,0,"K")), sim.plant.nDim*sim.plant.nFeatures*sizeof(double));
+            memcpy(sim.plant.A, mxGetPr(mxGetField(plant,0,"A")), sim.plant.nDim*sim.plant.nDim*sizeof(double));
+            memcpy(sim.plant.H, mxGetPr(mxGetField(plant,0,"H")), sim.plant.nFeatures*sim.plant.nDim*sizeof(double));
+            precomputeKalmanPlant(&sim.plant);
+        }
+        else if(sim.plant.decoderType!=0)
+        {
+            mexErrMsgTxt("opts.plant.decoderType should be 0 (alpha, beta plant) or 1 (Kalman filter).");
+        }
 
+        checkConfigRanges();
+        loadedControl = sim.control;
+        
         //keep track of whether we have successfully made it all the way through an initialization, in which case we can assume data is safe
         initialized = 1;
+        
+        if(nlhs > 0)
+            plhs[0] = makeConfigBlob();
     }
-    else if (strcmp(funcString,"run")==0)
+    else if (strcmp(funcString,"set")==0)
     {
-        //update target position and initial plant/control history values and then simulate a movement
-        if( nlhs != 5)
+        //Update the parameters given as fields of opts (a flat struct, e.g. struct('alpha',0.9,'fVelX',[0 1],'fVelY',[0 -1])).
+        //Only the checks and precomputation that depend on those parameters are repeated. The structure of the simulation 
+        //(nDim, forwardModel, decoderType and the number of neural features) can only be changed with 'init'. 
+        //With one output, returns a configuration blob of the updated configuration.
+        if(!initialized)
+            mexErrMsgTxt("Initialize the model first by calling 'init'.");
+        if( nlhs > 1)
+            mexErrMsgTxt("When calling 'set', must have at most one output.");
+        
+        setParameters(opts);
+        loadedControl = sim.control;
+        
+        //a snapshot taken with the old parameters would not match a movement simulated with the new ones. A movement 
+        //in progress in the single-step interface continues with the new parameters, including the target deadzone, 
+        //which 'reset' caches.
+        snapshotReady = 0;
+        if(stepReady)
+            stepState.deadzoneToUse = targetDeadzone(&sim);
+        
+        if(nlhs > 0)
+            plhs[0] = makeConfigBlob();
+    }
+    else if ((strcmp(funcString,"run")==0) || (strcmp(funcString,"runSens")==0) || (strcmp(funcString,"runPrefix")==0))
+    {
+        //update target position and initial plant/control history values and then simulate a movement.
+        //For 'run', opts can also contain fTargX/fTargY and/or fVelX/fVelY to simulate this movement with a candidate
+        //control policy, as in 'fork'.
+        runSens = (strcmp(funcString,"runSens")==0);
+        runPrefix = (strcmp(funcString,"runPrefix")==0);
+        if( runPrefix && nlhs > 1)
+            mexErrMsgTxt("When calling 'runPrefix', must have at most one output.");
+        if( !runSens && !runPrefix && nlhs != 5)
             mexErrMsgTxt("When calling 'run', must have five outputs.");
+        if( runSens && nlhs != 7 && nlhs != 9)
+            mexErrMsgTxt("When calling 'runSens', must have seven or nine outputs.");
+        if( runSens && sim.plant.decoderType != 0)
+            mexErrMsgTxt("'runSens' only supports the (alpha, beta) plant (opts.plant.decoderType = 0).");
         
         if(!initialized)
             mexErrMsgTxt("Initialize the model first by calling 'init'.");
         
         checkFields(opts,fieldsRunOpts,6,"opts");
+        if(runPrefix)
+            checkFields(opts,fieldsPrefixOpts,1,"opts");
         
         targetPos = mxGetField(opts,0,"targetPos");
         noiseMatrix = mxGetField(opts,0,"noiseMatrix");
@@ -135,7 +334,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         checkVectorLen(targetPos, sim.plant.nDim, "Dimensions of opts.targetPos sohuld match opts.plant.nDim");
         memcpy(sim.trial.targetPos, mxGetPr(targetPos), sim.plant.nDim*sizeof(double));
         
-        checkMatRows(noiseMatrix, sim.plant.nDim, "Number of rows in opts.noiseMatrix should be equal to opts.plant.nDim.");
+        checkNoiseMatrix(noiseMatrix);
         sim.noise.noiseMatrix = mxGetPr(noiseMatrix);
         sim.noise.noiseIdx = ((int)mxGetScalar(mxGetField(opts,0,"noiseIdx")))-1;
         sim.noise.nColsForNoiseMatrix = mxGetN(noiseMatrix);
@@ -170,35 +369,221 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         memcpy(sim.cMatrix, mxGetPr(initC), (sim.plant.nDim * nInitRows)*sizeof(double));
         sim.loopIdx = nInitRows;
         
+        //nothing can fail between applying a candidate policy and restoring the loaded one, so it never stays in effect
+        policyChanged = 0;
+        if(!runPrefix && !runSens)
+            policyChanged = copyControlPolicy(opts);
+        else if(mxGetField(opts,0,"fTargY")!=NULL || mxGetField(opts,0,"fVelY")!=NULL || 
+                mxGetField(opts,0,"fTargX")!=NULL || mxGetField(opts,0,"fVelX")!=NULL)
+            mexErrMsgTxt("'runPrefix' and 'runSens' use the control policy loaded by 'init' or 'set'.");
+        
         //simulate
-        simulate(&sim);
-        
-        //return results matrices
-        plhs[0] = mxCreateNumericMatrix(0, 0, mxDOUBLE_CLASS, mxREAL);
-        plhs[1] = mxCreateNumericMatrix(0, 0, mxDOUBLE_CLASS, mxREAL);
-        plhs[2] = mxCreateNumericMatrix(0, 0, mxDOUBLE_CLASS, mxREAL);
-        plhs[3] = mxCreateNumericMatrix(0, 0, mxDOUBLE_CLASS, mxREAL);
-        plhs[4] = mxCreateDoubleScalar(sim.loopIdx);
-        
-        mxSetPr(plhs[0], sim.xMatrix);
-        mxSetM(plhs[0], 2*sim.plant.nDim);
-        mxSetN(plhs[0], sim.maxLoops);
-        
-        mxSetPr(plhs[1], sim.xHatMatrix);
-        mxSetM(plhs[1], 2*sim.plant.nDim);
-        mxSetN(plhs[1], sim.maxLoops);
-        
-        mxSetPr(plhs[2], sim.uMatrix);
-        mxSetM(plhs[2], sim.plant.nDim);
-        mxSetN(plhs[2], sim.maxLoops);
-        
-        mxSetPr(plhs[3], sim.cMatrix);
-        mxSetM(plhs[3], sim.plant.nDim);
-        mxSetN(plhs[3], sim.maxLoops);
+        if(runPrefix)
+        {
+            sim.nLoops = 1;
+            sim.timeInTarget = 0;
+            sim.done = 0;
+            simulateLoops(&sim, (int)mxGetScalar(mxGetField(opts,0,"prefixLoops")));
+            
+            //the snapshot matrices are kept between calls, and only reallocated when the movement length changes
+            if(snapshotMaxLoops != sim.maxLoops)
+            {
+                freeSnapshot();
+                snapshot.xMatrix = allocPersistentMatrix(2 * sim.plant.nDim * sim.maxLoops);
+                snapshot.xHatMatrix = allocPersistentMatrix(2 * sim.plant.nDim * sim.maxLoops);
+                snapshot.uMatrix = allocPersistentMatrix(sim.plant.nDim * sim.maxLoops);
+                snapshot.cMatrix = allocPersistentMatrix(sim.plant.nDim * sim.maxLoops);
+                snapshotMaxLoops = sim.maxLoops;
+            }
+            takeSnapshot(&sim, &snapshot);
+            snapshotNoiseCols = sim.noise.nColsForNoiseMatrix;
+            snapshotReady = 1;
+            
+            if(nlhs > 0)
+                plhs[0] = mxCreateDoubleScalar(sim.done);
+            
+            mxFree(sim.xMatrix);
+            mxFree(sim.xHatMatrix);
+            mxFree(sim.uMatrix);
+            mxFree(sim.cMatrix);
+        }
+        else if(runSens)
+        {
+            //The tangents of the initial history are zero unless opts.initDx and opts.initDc are given, e.g. when the 
+            //movement continues from the end of a previous one. They have the layout of the last two outputs: one column 
+            //per column of initX/initC, holding the tangent vector of each element in turn.
+            sim.sens.nParams = 2 + sim.control.nfTarg + sim.control.nfVel;
+            sim.sens.dxMatrix = mxCalloc(2 * sim.plant.nDim * sim.sens.nParams * sim.maxLoops, sizeof(double));
+            sim.sens.dcMatrix = mxCalloc(sim.plant.nDim * sim.sens.nParams * sim.maxLoops, sizeof(double));
+            
+            if((mxGetField(opts,0,"initDx")!=NULL) || (mxGetField(opts,0,"initDc")!=NULL))
+            {
+                checkFields(opts,fieldsSensOpts,2,"opts");
+                checkMatRows(mxGetField(opts,0,"initDx"), 2*sim.plant.nDim*sim.sens.nParams, "Number of rows in opts.initDx should be equal to 2*opts.plant.nDim times the number of parameters.");
+                checkMatRows(mxGetField(opts,0,"initDc"), sim.plant.nDim*sim.sens.nParams, "Number of rows in opts.initDc should be equal to opts.plant.nDim times the number of parameters.");
+                if((mxGetN(mxGetField(opts,0,"initDx"))!=nInitRows) || (mxGetN(mxGetField(opts,0,"initDc"))!=nInitRows))
+                    mexErrMsgTxt("opts.initDx and opts.initDc should have the same number of columns as opts.initX.");
+                memcpy(sim.sens.dxMatrix, mxGetPr(mxGetField(opts,0,"initDx")), 2*sim.plant.nDim*sim.sens.nParams*nInitRows*sizeof(double));
+                memcpy(sim.sens.dcMatrix, mxGetPr(mxGetField(opts,0,"initDc")), sim.plant.nDim*sim.sens.nParams*nInitRows*sizeof(double));
+            }
+            
+            simulateSensitivity(&sim);
+            
+            //return results matrices
+            setRunOutputs(plhs);
+            plhs[5] = mxCreateDoubleScalar(sim.sens.cost);
+            plhs[6] = mxCreateDoubleMatrix(sim.sens.nParams, 1, mxREAL);
+            costGrad = mxGetPr(plhs[6]);
+            memcpy(costGrad, sim.sens.costGrad, sim.sens.nParams*sizeof(double));
+            
+            if(nlhs==9)
+            {
+                plhs[7] = mxCreateNumericMatrix(0, 0, mxDOUBLE_CLASS, mxREAL);
+                mxSetPr(plhs[7], sim.sens.dxMatrix);
+                mxSetM(plhs[7], 2*sim.plant.nDim*sim.sens.nParams);
+                mxSetN(plhs[7], sim.maxLoops);
+                
+                plhs[8] = mxCreateNumericMatrix(0, 0, mxDOUBLE_CLASS, mxREAL);
+                mxSetPr(plhs[8], sim.sens.dcMatrix);
+                mxSetM(plhs[8], sim.plant.nDim*sim.sens.nParams);
+                mxSetN(plhs[8], sim.maxLoops);
+            }
+            else
+            {
+                mxFree(sim.sens.dxMatrix);
+                mxFree(sim.sens.dcMatrix);
+            }
+        }
+        else
+        {
+            simulate(&sim);
+            
+            //return results matrices
+            setRunOutputs(plhs);
+        }
+        
+        if(policyChanged)
+            sim.control = loadedControl;
+    }
+    else if (strcmp(funcString,"fork")==0)
+    {
+        //Complete the movement from the snapshot taken by 'runPrefix'. opts.noiseMatrix must be the noise matrix that 
+        //was passed to 'runPrefix'. opts can also contain new fTargX/fTargY and/or fVelX/fVelY control policy functions, 
+        //which are only used for this movement. Returns the same outputs as 'run'.
+        if( nlhs != 5)
+            mexErrMsgTxt("When calling 'fork', must have five outputs.");
+        if(!snapshotReady)
+            mexErrMsgTxt("Call 'runPrefix' before calling 'fork'.");
+        
+        checkFields(opts,fieldsForkOpts,1,"opts");
+        noiseMatrix = mxGetField(opts,0,"noiseMatrix");
+        checkNoiseMatrix(noiseMatrix);
+        if(mxGetN(noiseMatrix)!=snapshotNoiseCols)
+            mexErrMsgTxt("opts.noiseMatrix should be the same noise matrix that was passed to 'runPrefix'.");
+        sim.noise.noiseMatrix = mxGetPr(noiseMatrix);
+        sim.noise.nColsForNoiseMatrix = snapshotNoiseCols;
+        
+        //the control policy has no effect during the reaction time, so it can only change if the prefix did not go past it
+        if((mxGetField(opts,0,"fTargY")!=NULL) || (mxGetField(opts,0,"fVelY")!=NULL) || 
+           (mxGetField(opts,0,"fTargX")!=NULL) || (mxGetField(opts,0,"fVelX")!=NULL))
+        {
+            if(snapshot.nLoops - 1 > sim.control.rtSteps)
+                mexErrMsgTxt("The control policy can only be changed in 'fork' if opts.prefixLoops <= opts.control.rtSteps.");
+        }
+        policyChanged = copyControlPolicy(opts);
+        
+        sim.maxLoops = snapshotMaxLoops;
+        sim.xMatrix = mxCalloc(2 * sim.plant.nDim * sim.maxLoops, sizeof(double));
+        sim.xHatMatrix = mxCalloc(2 * sim.plant.nDim * sim.maxLoops, sizeof(double));
+        sim.uMatrix = mxCalloc(sim.plant.nDim * sim.maxLoops, sizeof(double));
+        sim.cMatrix = mxCalloc(sim.plant.nDim * sim.maxLoops, sizeof(double));
+        
+        restoreSnapshot(&sim, &snapshot);
+        simulateLoops(&sim, -1);
+        
+        setRunOutputs(plhs);
+        if(policyChanged)
+            sim.control = loadedControl;
+    }
+    else if (strcmp(funcString,"reset")==0)
+    {
+        //load a target and cursor state history for the single-step interface, and return the first control vector
+        //and the current cursor state
+        if(!initialized)
+            mexErrMsgTxt("Initialize the model first by calling 'init'.");
+        if(nlhs > 2)
+            mexErrMsgTxt("When calling 'reset', must have at most two outputs.");
+        if(sim.forwardModel.forwardSteps > sim.forwardModel.delaySteps)
+            mexErrMsgTxt("The single-step interface requires opts.forwardModel.forwardSteps <= opts.forwardModel.delaySteps.");
+        
+        checkFields(opts,fieldsResetOpts,4,"opts");
+        
+        targetPos = mxGetField(opts,0,"targetPos");
+        initX = mxGetField(opts,0,"initX");
+        initC = mxGetField(opts,0,"initC");
+        
+        sim.trial.targRad = mxGetScalar(mxGetField(opts,0,"targRad"));
+        
+        checkVectorLen(targetPos, sim.plant.nDim, "Dimensions of opts.targetPos sohuld match opts.plant.nDim");
+        memcpy(sim.trial.targetPos, mxGetPr(targetPos), sim.plant.nDim*sizeof(double));
+        
+        checkMatRows(initC, sim.plant.nDim, "Number of rows in opts.initC should be equal to opts.plant.nDim.");
+        checkMatRows(initX, 2*sim.plant.nDim, "Number of rows in opts.initX should be equal to 2*opts.plant.nDim.");
+        if(mxGetN(initC)!=mxGetN(initX))
+            mexErrMsgTxt("opts.initX and opts.initC should have the same number of columns.");
+        
+        nInitRows = mxGetN(initC);
+        if(nInitRows < sim.forwardModel.delaySteps + 1)
+            mexErrMsgTxt("opts.initX and opts.initC must have at least opts.forwardModel.delaySteps+1 columns.");
+        
+        //the ring buffers only depend on the forward model settings, so they are allocated here once after each 'init'
+        if(stepState.xRing==NULL)
+        {
+            stepState.ringSize = stepRingSize(&sim);
+            stepState.xRing = allocPersistentMatrix(2 * sim.plant.nDim * stepState.ringSize);
+            stepState.cRing = allocPersistentMatrix(sim.plant.nDim * stepState.ringSize);
+        }
+        
+        stepReset(&sim, &stepState, mxGetPr(initX), mxGetPr(initC), nInitRows);
+        stepReady = 1;
+        
+        plhs[0] = stepOutput(stepState.c, sim.plant.nDim);
+        if(nlhs > 1)
+            plhs[1] = stepOutput(&(stepState.xRing[2 * sim.plant.nDim * (stepState.loopIdx & (stepState.ringSize-1))]), 2 * sim.plant.nDim);
+    }
+    else if (strcmp(funcString,"stepTiming")==0)
+    {
+        //Times opts (a scalar) calls to step() inside the mex function and returns the average time per step in 
+        //microseconds, measured with a monotonic wall clock (see monotonicTime), and optionally the resolution of that 
+        //clock in microseconds. Each control vector is decoded by the simulator with zero noise, as 'stepNoise' would, so for the 
+        //Kalman filter plant the neural features are generated and decoded too. This measures the simulator's own 
+        //per-step cost, without the MATLAB call overhead. It continues the movement loaded by 'reset', so call 'reset' 
+        //again afterwards.
+        if(!stepReady)
+            mexErrMsgTxt("Call 'reset' before calling 'stepTiming'.");
+        if(nlhs > 2)
+            mexErrMsgTxt("When calling 'stepTiming', must have at most two outputs.");
+        
+        nSteps = (int)mxGetScalar(opts);
+        if(nSteps < 1)
+            mexErrMsgTxt("The input to 'stepTiming' should be a positive number of steps.");
+        
+        zeroNoise = mxCalloc((sim.plant.decoderType==1) ? sim.plant.nFeatures : sim.plant.nDim, sizeof(double));
+        startTime = monotonicTime(&clockResolution);
+        for(s=0; s<nSteps; s++)
+            step(&sim, &stepState, zeroNoise, 0);
+        plhs[0] = mxCreateDoubleScalar(1e6 * (monotonicTime(&clockResolution) - startTime) / nSteps);
+        if(nlhs > 1)
+            plhs[1] = mxCreateDoubleScalar(1e6 * clockResolution);
+        mxFree(zeroNoise);
+    }
+    else if (strcmp(funcString,"version")==0)
+    {
+        plhs[0] = mxCreateDoubleScalar(SIMBCI_INTERFACE_VERSION);
     }
     else
     {
-        mexErrMsgTxt("The second input must equal \"init\" or \"run\".");
+        mexErrMsgTxt("The second input must equal \"init\", \"set\", \"run\", \"runSens\", \"runPrefix\", \"fork\", \"reset\", \"step\", \"stepNoise\", \"stepTiming\" or \"version\".");
     }
 
     mxFree(funcString);
@@ -245,14 +630,550 @@ void checkMatrixSizeEquality(mxArray *m1, mxArray *m2, char *errMsg)
     }
 }
 
-void copyPwlFunction(double *x, double *y, int *nKnots, mxArray *x_src, mxArray *y_src)
+//returns the number of knots of a piecewise linear function, which must fit in the simulator's fixed size arrays
+int pwlKnots(mxArray *x_src)
 {
+    int nKnots;
+    
     if( mxGetM(x_src) > mxGetN(x_src) )
-        *nKnots = (int)mxGetM(x_src);
+        nKnots = (int)mxGetM(x_src);
     else
-        *nKnots = (int)mxGetN(x_src);
+        nKnots = (int)mxGetN(x_src);
+    
+    if(nKnots > MAX_PWL_KNOTS)
+        mexErrMsgTxt("Piecewise linear functions can have at most MAX_PWL_KNOTS (100) knots.");
+    return nKnots;
+}
+
+//piecewise linear functions that are evaluated (pwl_value_1d_scalar) need at least one knot
+void checkPwlNotEmpty(mxArray *x_src, char *errMsg)
+{
+    if(mxGetNumberOfElements(x_src)==0)
+        mexErrMsgTxt(errMsg);
+}
+
+void copyPwlFunction(double *x, double *y, int *nKnots, mxArray *x_src, mxArray *y_src)
+{
+    *nKnots = pwlKnots(x_src);
 
     memcpy(x, mxGetPr(x_src), (*nKnots)*sizeof(double));
     memcpy(y, mxGetPr(y_src), (*nKnots)*sizeof(double));
 }
 
+//allocates memory that persists between calls to the mex function
+double *allocPersistentMatrix(int nElements)
+{
+    static int exitRegistered = 0;
+    double *dest;
+    
+    if(!exitRegistered)
+    {
+        mexAtExit(freePersistentMemory);
+        exitRegistered = 1;
+    }
+    
+    dest = mxCalloc(nElements, sizeof(double));
+    mexMakeMemoryPersistent(dest);
+    return dest;
+}
+
+//returns the simulator's state and control vector matrices (which are handed over to MATLAB) and the final loop index,
+//as the five outputs of 'run'
+void setRunOutputs(mxArray *plhs[])
+{
+    plhs[0] = mxCreateNumericMatrix(0, 0, mxDOUBLE_CLASS, mxREAL);
+    plhs[1] = mxCreateNumericMatrix(0, 0, mxDOUBLE_CLASS, mxREAL);
+    plhs[2] = mxCreateNumericMatrix(0, 0, mxDOUBLE_CLASS, mxREAL);
+    plhs[3] = mxCreateNumericMatrix(0, 0, mxDOUBLE_CLASS, mxREAL);
+    plhs[4] = mxCreateDoubleScalar(sim.loopIdx);
+    
+    mxSetPr(plhs[0], sim.xMatrix);
+    mxSetM(plhs[0], 2*sim.plant.nDim);
+    mxSetN(plhs[0], sim.maxLoops);
+    
+    mxSetPr(plhs[1], sim.xHatMatrix);
+    mxSetM(plhs[1], 2*sim.plant.nDim);
+    mxSetN(plhs[1], sim.maxLoops);
+    
+    mxSetPr(plhs[2], sim.uMatrix);
+    mxSetM(plhs[2], sim.plant.nDim);
+    mxSetN(plhs[2], sim.maxLoops);
+    
+    mxSetPr(plhs[3], sim.cMatrix);
+    mxSetM(plhs[3], sim.plant.nDim);
+    mxSetN(plhs[3], sim.maxLoops);
+}
+
+void checkNoiseMatrix(mxArray *noiseMatrix)
+{
+    if(sim.plant.decoderType==1)
+        checkMatRows(noiseMatrix, sim.plant.nFeatures, "For the Kalman filter plant, the number of rows in opts.noiseMatrix should be equal to the number of neural features.");
+    else
+        checkMatRows(noiseMatrix, sim.plant.nDim, "Number of rows in opts.noiseMatrix should be equal to opts.plant.nDim.");
+}
+
+//replaces the fTarg and/or fVel functions of the control policy with those in opts (fTargX/fTargY, fVelX/fVelY), and 
+//returns whether there were any. Both are checked before either is copied.
+int copyControlPolicy(const mxArray *opts)
+{
+    char fieldsFTarg[][20] = {"fTargX","fTargY"};
+    char fieldsFVel[][20] = {"fVelX","fVelY"};
+    int hasFTarg = (mxGetField(opts,0,"fTargX")!=NULL) || (mxGetField(opts,0,"fTargY")!=NULL);
+    int hasFVel = (mxGetField(opts,0,"fVelX")!=NULL) || (mxGetField(opts,0,"fVelY")!=NULL);
+    
+    if(hasFTarg)
+    {
+        checkFields(opts,fieldsFTarg,2,"opts");
+        checkMatrixSizeEquality(mxGetField(opts,0,"fTargX"), mxGetField(opts,0,"fTargY"), "Dimensions of opts.fTargX and opts.fTargY should be equal");
+        checkPwlNotEmpty(mxGetField(opts,0,"fTargX"), "opts.fTargX and opts.fTargY should have at least one knot.");
+        pwlKnots(mxGetField(opts,0,"fTargX"));
+    }
+    if(hasFVel)
+    {
+        checkFields(opts,fieldsFVel,2,"opts");
+        checkMatrixSizeEquality(mxGetField(opts,0,"fVelX"), mxGetField(opts,0,"fVelY"), "Dimensions of opts.fVelX and opts.fVelY should be equal");
+        checkPwlNotEmpty(mxGetField(opts,0,"fVelX"), "opts.fVelX and opts.fVelY should have at least one knot.");
+        pwlKnots(mxGetField(opts,0,"fVelX"));
+    }
+    
+    if(hasFTarg)
+        copyPwlFunction(sim.control.fTargX, sim.control.fTargY, &sim.control.nfTarg, mxGetField(opts,0,"fTargX"), mxGetField(opts,0,"fTargY"));
+    if(hasFVel)
+        copyPwlFunction(sim.control.fVelX, sim.control.fVelY, &sim.control.nfVel, mxGetField(opts,0,"fVelX"), mxGetField(opts,0,"fVelY"));
+    return hasFTarg || hasFVel;
+}
+
+//updates the parameters that are fields of opts. Every field is checked before any parameter changes, so a failed 'set'
+//leaves the configuration as it was.
+void setParameters(const mxArray *opts)
+{
+    char fieldsDouble[][20] = {"loopTime","dwellTime","maxTrialTime","alpha","beta","n1","n2","targetDeadzone"};
+    double *doubleParams[8] = {&sim.loopTime, &sim.trial.dwellTime, &sim.trial.maxTrialTime, &sim.plant.alpha, &sim.plant.beta,
+        &sim.plant.n1, &sim.plant.n2, &sim.control.targetDeadzone};
+    char fieldsInt[][20] = {"continuousHoldRule","nonlinType","rtSteps"};
+    int *intParams[3] = {&sim.trial.continuousHoldRule, &sim.plant.nonlinType, &sim.control.rtSteps};
+    
+    char fieldsPwlX[][20] = {"fStaticX","sdnX","fTargX","fVelX"};
+    char fieldsPwlY[][20] = {"fStaticY","sdnY","fTargY","fVelY"};
+    double *pwlX[4] = {sim.plant.fStaticX, sim.noise.sdnX, sim.control.fTargX, sim.control.fVelX};
+    double *pwlY[4] = {sim.plant.fStaticY, sim.noise.sdnY, sim.control.fTargY, sim.control.fVelY};
+    int *pwlKnotCounts[4] = {&sim.plant.nfStatic, &sim.noise.nsdn, &sim.control.nfTarg, &sim.control.nfVel};
+    
+    char fieldsKalman[][20] = {"K","A","H"};
+    double *kalmanParams[3] = {sim.plant.K, sim.plant.A, sim.plant.H};
+    int kalmanRows[3] = {sim.plant.nDim, sim.plant.nDim, sim.plant.nFeatures};
+    int kalmanCols[3] = {sim.plant.nFeatures, sim.plant.nDim, sim.plant.nDim};
+    int kalmanChanged = 0;
+    
+    mxArray *value;
+    const char *name;
+    char errMsg[200];
+    int f, p, known;
+    
+    if(!mxIsStruct(opts))
+        mexErrMsgTxt("The first input to 'set' should be a struct of parameters.");
+    
+    //check every field
+    for(f=0; f<mxGetNumberOfFields(opts); f++)
+    {
+        name = mxGetFieldNameByNumber(opts,f);
+        value = mxGetFieldByNumber(opts,0,f);
+        known = 0;
+        
+        for(p=0; p<8; p++)
+            known = known || (strcmp(name,fieldsDouble[p])==0);
+        for(p=0; p<3; p++)
+            known = known || (strcmp(name,fieldsInt[p])==0);
+        if(known && mxGetNumberOfElements(value)!=1)
+        {
+            sprintf(errMsg,"opts.%s should be a scalar.",name);
+            mexErrMsgTxt(errMsg);
+        }
+        
+        for(p=0; p<4; p++)
+        {
+            if((strcmp(name,fieldsPwlX[p])==0) || (strcmp(name,fieldsPwlY[p])==0))
+            {
+                known = 1;
+                if((mxGetField(opts,0,fieldsPwlX[p])==NULL) || (mxGetField(opts,0,fieldsPwlY[p])==NULL))
+                {
+                    sprintf(errMsg,"opts.%s and opts.%s must be set together.",fieldsPwlX[p],fieldsPwlY[p]);
+                    mexErrMsgTxt(errMsg);
+                }
+                sprintf(errMsg,"Dimensions of opts.%s and opts.%s should be equal",fieldsPwlX[p],fieldsPwlY[p]);
+                checkMatrixSizeEquality(mxGetField(opts,0,fieldsPwlX[p]), mxGetField(opts,0,fieldsPwlY[p]), errMsg);
+                pwlKnots(value);
+                
+                //fStatic is only evaluated for nonlinType 3, the others on every time step
+                if(p > 0)
+                {
+                    sprintf(errMsg,"opts.%s and opts.%s should have at least one knot.",fieldsPwlX[p],fieldsPwlY[p]);
+                    checkPwlNotEmpty(value, errMsg);
+                }
+            }
+        }
+        
+        for(p=0; p<3; p++)
+        {
+            if(strcmp(name,fieldsKalman[p])==0)
+            {
+                known = 1;
+                if(sim.plant.decoderType!=1)
+                    mexErrMsgTxt("opts.K, opts.A and opts.H can only be set for the Kalman filter plant (opts.plant.decoderType = 1).");
+                if((mxGetM(value)!=kalmanRows[p]) || (mxGetN(value)!=kalmanCols[p]))
+                {
+                    sprintf(errMsg,"opts.%s should have the same dimensions as when the simulator was initialized.",name);
+                    mexErrMsgTxt(errMsg);
+                }
+            }
+        }
+        
+        if(!known)
+        {
+            sprintf(errMsg,"ERROR: \"%s\" is not a parameter that can be changed with 'set' \n",name);
+            mexErrMsgTxt(errMsg);
+        }
+    }
+    
+    //apply them, and redo the precomputation that depends on them
+    for(p=0; p<8; p++)
+    {
+        if(mxGetField(opts,0,fieldsDouble[p])!=NULL)
+            *doubleParams[p] = mxGetScalar(mxGetField(opts,0,fieldsDouble[p]));
+    }
+    for(p=0; p<3; p++)
+    {
+        if(mxGetField(opts,0,fieldsInt[p])!=NULL)
+            *intParams[p] = (int)mxGetScalar(mxGetField(opts,0,fieldsInt[p]));
+    }
+    for(p=0; p<4; p++)
+    {
+        if(mxGetField(opts,0,fieldsPwlY[p])!=NULL)
+            copyPwlFunction(pwlX[p], pwlY[p], pwlKnotCounts[p], mxGetField(opts,0,fieldsPwlX[p]), mxGetField(opts,0,fieldsPwlY[p]));
+    }
+    for(p=0; p<3; p++)
+    {
+        if(mxGetField(opts,0,fieldsKalman[p])!=NULL)
+        {
+            memcpy(kalmanParams[p], mxGetPr(mxGetField(opts,0,fieldsKalman[p])), kalmanRows[p]*kalmanCols[p]*sizeof(double));
+            kalmanChanged = 1;
+        }
+    }
+    if(kalmanChanged)
+        precomputeKalmanPlant(&sim.plant);
+}
+
+//allocates the Kalman filter plant matrices for the current nDim and nFeatures
+void allocKalmanPlant(void)
+{
+    sim.plant.K = allocPersistentMatrix(sim.plant.nDim * sim.plant.nFeatures);
+    sim.plant.A = allocPersistentMatrix(sim.plant.nDim * sim.plant.nDim);
+    sim.plant.H = allocPersistentMatrix(sim.plant.nFeatures * sim.plant.nDim);
+    sim.plant.kalmanM = allocPersistentMatrix(sim.plant.nDim * sim.plant.nDim);
+    sim.plant.kalmanKH = allocPersistentMatrix(sim.plant.nDim * sim.plant.nDim);
+    sim.plant.kalmanKt = allocPersistentMatrix(sim.plant.nDim * sim.plant.nFeatures);
+    sim.plant.features = allocPersistentMatrix(sim.plant.nFeatures);
+}
+
+//size in bytes of the configuration blob of the current configuration
+int configBlobSize(void)
+{
+    int nBytes = sizeof(struct configBlobHeader) + sizeof(struct simTrial) + sizeof(struct simForwardModel) + 
+        sizeof(struct simPlant) + sizeof(struct simNoise) + sizeof(struct simController);
+    
+    if(sim.plant.decoderType==1)
+        nBytes += (3*sim.plant.nDim*sim.plant.nFeatures + 3*sim.plant.nDim*sim.plant.nDim)*sizeof(double);
+    return nBytes;
+}
+
+mxArray *makeConfigBlob(void)
+{
+    struct configBlobHeader header;
+    struct simTrial trial;
+    struct simPlant plant;
+    struct simNoise noise;
+    struct simController control;
+    mxArray *blob;
+    unsigned char *dest;
+    int nDimSq = sim.plant.nDim * sim.plant.nDim;
+    int nDimFeat = sim.plant.nDim * sim.plant.nFeatures;
+    
+    //Only the configuration goes into the blob, so that equal configurations give identical blobs: the values of the 
+    //last movement, pointers to this process's memory and unused knots are zeroed. The copies are made with memcpy so 
+    //that struct padding comes along unchanged.
+    memcpy(&trial, &sim.trial, sizeof(trial));
+    memcpy(&plant, &sim.plant, sizeof(plant));
+    memcpy(&noise, &sim.noise, sizeof(noise));
+    memcpy(&control, &sim.control, sizeof(control));
+    
+    memset(trial.targetPos, 0, sizeof(trial.targetPos));
+    trial.targRad = 0;
+    plant.K = plant.A = plant.H = NULL;
+    plant.kalmanM = plant.kalmanKH = plant.kalmanKt = plant.features = NULL;
+    noise.noiseMatrix = NULL;
+    noise.noiseIdx = 0;
+    noise.nColsForNoiseMatrix = 0;
+    zeroUnusedKnots(plant.fStaticX, plant.fStaticY, plant.nfStatic);
+    zeroUnusedKnots(noise.sdnX, noise.sdnY, noise.nsdn);
+    zeroUnusedKnots(control.fTargX, control.fTargY, control.nfTarg);
+    zeroUnusedKnots(control.fVelX, control.fVelY, control.nfVel);
+    
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "SBCF", 4);
+    header.version = CONFIG_BLOB_VERSION;
+    header.nBytes = configBlobSize();
+    header.structSizes[0] = sizeof(struct simTrial);
+    header.structSizes[1] = sizeof(struct simForwardModel);
+    header.structSizes[2] = sizeof(struct simPlant);
+    header.structSizes[3] = sizeof(struct simNoise);
+    header.structSizes[4] = sizeof(struct simController);
+    header.nDim = sim.plant.nDim;
+    header.nFeatures = sim.plant.nFeatures;
+    header.decoderType = sim.plant.decoderType;
+    header.loopTime = sim.loopTime;
+    
+    blob = mxCreateNumericMatrix(1, header.nBytes, mxUINT8_CLASS, mxREAL);
+    dest = (unsigned char *)mxGetData(blob);
+    
+    memcpy(dest, &header, sizeof(header));                        dest += sizeof(header);
+    memcpy(dest, &trial, sizeof(struct simTrial));                dest += sizeof(struct simTrial);
+    memcpy(dest, &sim.forwardModel, sizeof(struct simForwardModel)); dest += sizeof(struct simForwardModel);
+    memcpy(dest, &plant, sizeof(struct simPlant));                dest += sizeof(struct simPlant);
+    memcpy(dest, &noise, sizeof(struct simNoise));                dest += sizeof(struct simNoise);
+    memcpy(dest, &control, sizeof(struct simController));         dest += sizeof(struct simController);
+    
+    if(sim.plant.decoderType==1)
+    {
+        memcpy(dest, sim.plant.K, nDimFeat*sizeof(double));        dest += nDimFeat*sizeof(double);
+        memcpy(dest, sim.plant.A, nDimSq*sizeof(double));          dest += nDimSq*sizeof(double);
+        memcpy(dest, sim.plant.H, nDimFeat*sizeof(double));        dest += nDimFeat*sizeof(double);
+        memcpy(dest, sim.plant.kalmanM, nDimSq*sizeof(double));    dest += nDimSq*sizeof(double);
+        memcpy(dest, sim.plant.kalmanKH, nDimSq*sizeof(double));   dest += nDimSq*sizeof(double);
+        memcpy(dest, sim.plant.kalmanKt, nDimFeat*sizeof(double));
+    }
+    return blob;
+}
+
+//restores the configuration from a blob made by makeConfigBlob. Its layout is checked, and so are the settings that 
+//array sizes and indexing depend on (checkConfigRanges), so that an edited or corrupted blob cannot make the simulator 
+//read or write out of bounds. Expects the persistent memory to be freed already.
+void loadConfigBlob(const mxArray *blob)
+{
+    struct configBlobHeader header;
+    unsigned char *src = (unsigned char *)mxGetData(blob);
+    int nDimSq, nDimFeat;
+    
+    if(mxGetNumberOfElements(blob) < sizeof(header))
+        mexErrMsgTxt("The configuration blob is too short.");
+    memcpy(&header, src, sizeof(header));
+    src += sizeof(header);
+    
+    if(memcmp(header.magic, "SBCF", 4)!=0 || header.version!=CONFIG_BLOB_VERSION || header.nBytes!=mxGetNumberOfElements(blob))
+        mexErrMsgTxt("The first input is not a configuration blob made by simBci 'init' or 'set'.");
+    if(header.structSizes[0]!=sizeof(struct simTrial) || header.structSizes[1]!=sizeof(struct simForwardModel) || 
+       header.structSizes[2]!=sizeof(struct simPlant) || header.structSizes[3]!=sizeof(struct simNoise) || 
+       header.structSizes[4]!=sizeof(struct simController))
+        mexErrMsgTxt("The configuration blob was made by a different build of simBci. Call 'init' with the options struct instead.");
+    
+    sim.loopTime = header.loopTime;
+    memcpy(&sim.trial, src, sizeof(struct simTrial));             src += sizeof(struct simTrial);
+    memcpy(&sim.forwardModel, src, sizeof(struct simForwardModel)); src += sizeof(struct simForwardModel);
+    memcpy(&sim.plant, src, sizeof(struct simPlant));             src += sizeof(struct simPlant);
+    memcpy(&sim.noise, src, sizeof(struct simNoise));             src += sizeof(struct simNoise);
+    memcpy(&sim.control, src, sizeof(struct simController));      src += sizeof(struct simController);
+    
+    //the pointers in the blob point to memory of the call that made it
+    sim.plant.K = sim.plant.A = sim.plant.H = NULL;
+    sim.plant.kalmanM = sim.plant.kalmanKH = sim.plant.kalmanKt = sim.plant.features = NULL;
+    sim.noise.noiseMatrix = NULL;
+    
+    checkConfigRanges();
+    if(sim.plant.nDim!=header.nDim || sim.plant.nFeatures!=header.nFeatures || sim.plant.decoderType!=header.decoderType ||
+       sim.plant.nFeatures > header.nBytes || configBlobSize()!=header.nBytes)
+        mexErrMsgTxt("The configuration blob is corrupted.");
+    
+    if(sim.plant.decoderType==1)
+    {
+        nDimSq = sim.plant.nDim * sim.plant.nDim;
+        nDimFeat = sim.plant.nDim * sim.plant.nFeatures;
+        allocKalmanPlant();
+        memcpy(sim.plant.K, src, nDimFeat*sizeof(double));        src += nDimFeat*sizeof(double);
+        memcpy(sim.plant.A, src, nDimSq*sizeof(double));          src += nDimSq*sizeof(double);
+        memcpy(sim.plant.H, src, nDimFeat*sizeof(double));        src += nDimFeat*sizeof(double);
+        memcpy(sim.plant.kalmanM, src, nDimSq*sizeof(double));    src += nDimSq*sizeof(double);
+        memcpy(sim.plant.kalmanKH, src, nDimSq*sizeof(double));   src += nDimSq*sizeof(double);
+        memcpy(sim.plant.kalmanKt, src, nDimFeat*sizeof(double));
+    }
+}
+
+//returns 1 if funcName is 'step', 2 if it is 'stepNoise' and 0 otherwise
+int stepSubcommand(const mxArray *funcName)
+{
+    const char *names[2] = {"step","stepNoise"};
+    mxChar *chars;
+    int len, n, i;
+    
+    if(!mxIsChar(funcName))
+        return 0;
+    
+    len = (int)mxGetNumberOfElements(funcName);
+    chars = mxGetChars(funcName);
+    for(n=0; n<2; n++)
+    {
+        if(len != (int)strlen(names[n]))
+            continue;
+        for(i=0; i<len && chars[i]==names[n][i]; i++);
+        if(i==len)
+            return n+1;
+    }
+    return 0;
+}
+
+//Advance one time step. The input is a plain vector (not a struct), so nothing is parsed here: for 'step' it is the 
+//decoded input (nDim x 1) and for 'stepNoise' it is noise (nDim x 1, or one sample per feature for the Kalman filter 
+//plant). Returns the next control vector, the new cursor state and whether the target was acquired. The outputs are 
+//new arrays on every call, since MATLAB takes ownership of a mex function's outputs, so their allocation is part of the 
+//latency seen from MATLAB (but not of the time measured by 'stepTiming').
+void stepCommand(int nlhs, mxArray *plhs[], const mxArray *input, int inputIsDecoded)
+{
+    int acquired;
+    
+    if(!stepReady)
+        mexErrMsgTxt("Call 'reset' before calling 'step'.");
+    if(nlhs > 3)
+        mexErrMsgTxt("When calling 'step', must have at most three outputs.");
+    
+    if(!mxIsDouble(input))
+        mexErrMsgTxt("The input to 'step' should be a double vector.");
+    if(inputIsDecoded || sim.plant.decoderType!=1)
+        checkVectorLen((mxArray *)input, sim.plant.nDim, "The input to 'step' should be a vector with opts.plant.nDim elements.");
+    else
+        checkVectorLen((mxArray *)input, sim.plant.nFeatures, "For the Kalman filter plant, the input to 'stepNoise' should have one element per neural feature.");
+    
+    acquired = step(&sim, &stepState, mxGetPr(input), inputIsDecoded);
+    
+    plhs[0] = stepOutput(stepState.c, sim.plant.nDim);
+    if(nlhs > 1)
+        plhs[1] = stepOutput(&(stepState.xRing[2 * sim.plant.nDim * (stepState.loopIdx & (stepState.ringSize-1))]), 2 * sim.plant.nDim);
+    if(nlhs > 2)
+        plhs[2] = mxCreateDoubleScalar(acquired);
+}
+
+//checks the settings that array sizes and indexing depend on
+void checkConfigRanges(void)
+{
+    int knotCounts[4] = {sim.plant.nfStatic, sim.noise.nsdn, sim.control.nfTarg, sim.control.nfVel};
+    int p;
+    
+    if(sim.plant.nDim < 1 || sim.plant.nDim > MAX_DIM)
+        mexErrMsgTxt("opts.plant.nDim should be between 1 and MAX_DIM (100).");
+    for(p=0; p<4; p++)
+    {
+        if(knotCounts[p] < 0 || knotCounts[p] > MAX_PWL_KNOTS)
+            mexErrMsgTxt("Piecewise linear functions can have at most MAX_PWL_KNOTS (100) knots.");
+        if(p > 0 && knotCounts[p] < 1)
+            mexErrMsgTxt("The noise and control policy piecewise linear functions should have at least one knot.");
+    }
+    if(sim.forwardModel.delaySteps < 0 || sim.forwardModel.forwardSteps < 0)
+        mexErrMsgTxt("opts.forwardModel.delaySteps and opts.forwardModel.forwardSteps should not be negative.");
+    if(sim.plant.decoderType!=0 && sim.plant.decoderType!=1)
+        mexErrMsgTxt("opts.plant.decoderType should be 0 (alpha, beta plant) or 1 (Kalman filter).");
+    if(sim.plant.decoderType==1 && sim.plant.nFeatures < 1)
+        mexErrMsgTxt("opts.plant.K should have at least one column (one per neural feature).");
+    if(sim.plant.decoderType==0 && sim.plant.nFeatures!=0)
+        mexErrMsgTxt("The (alpha, beta) plant has no neural features.");
+}
+
+void zeroUnusedKnots(double *x, double *y, int nKnots)
+{
+    memset(&x[nKnots], 0, (MAX_PWL_KNOTS-nKnots)*sizeof(double));
+    memset(&y[nKnots], 0, (MAX_PWL_KNOTS-nKnots)*sizeof(double));
+}
+
+//the settings of a loaded configuration that callers sizing their own buffers or mirroring its behavior need to know
+mxArray *configSettings(void)
+{
+    const char *names[10] = {"loopTime","maxTrialTime","rtSteps","delaySteps","forwardSteps","nDim","decoderType",
+        "nFeatures","nfTarg","nfVel"};
+    double values[10] = {sim.loopTime, sim.trial.maxTrialTime, sim.control.rtSteps, sim.forwardModel.delaySteps, 
+        sim.forwardModel.forwardSteps, sim.plant.nDim, sim.plant.decoderType, sim.plant.nFeatures, sim.control.nfTarg, 
+        sim.control.nfVel};
+    mxArray *settings = mxCreateStructMatrix(1, 1, 10, names);
+    int f;
+    
+    for(f=0; f<10; f++)
+        mxSetField(settings, 0, names[f], mxCreateDoubleScalar(values[f]));
+    return settings;
+}
+
+//Returns the time in seconds from a monotonic, high-resolution wall clock (with an arbitrary origin), and sets 
+//*resolution to the clock's resolution in seconds. clock() would measure process CPU time on most platforms, and on 
+//Windows has a resolution of about 1 ms.
+double monotonicTime(double *resolution)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    *resolution = 1.0 / (double)frequency.QuadPart;
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#elif defined(__APPLE__)
+    mach_timebase_info_data_t timebase;
+    
+    mach_timebase_info(&timebase);
+    *resolution = 1e-9 * (double)timebase.numer / (double)timebase.denom;
+    return (double)mach_absolute_time() * (*resolution);
+#else
+    struct timespec now;
+    struct timespec res;
+    
+    clock_getres(CLOCK_MONOTONIC, &res);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *resolution = (double)res.tv_sec + 1e-9 * (double)res.tv_nsec;
+    return (double)now.tv_sec + 1e-9 * (double)now.tv_nsec;
+#endif
+}
+
+//copies nElements values into a new column vector output
+mxArray *stepOutput(double *values, int nElements)
+{
+    mxArray *out = mxCreateDoubleMatrix(nElements, 1, mxREAL);
+    memcpy(mxGetPr(out), values, nElements*sizeof(double));
+    return out;
+}
+
+void freeSnapshot(void)
+{
+    double **matrices[4] = {&snapshot.xMatrix, &snapshot.xHatMatrix, &snapshot.uMatrix, &snapshot.cMatrix};
+    int m;
+    
+    for(m=0; m<4; m++)
+    {
+        if(*matrices[m]!=NULL)
+        {
+            mxFree(*matrices[m]);
+            *matrices[m] = NULL;
+        }
+    }
+    snapshotMaxLoops = 0;
+}
+
+void freePersistentMemory(void)
+{
+    double **matrices[9] = {&sim.plant.K, &sim.plant.A, &sim.plant.H, &sim.plant.kalmanM, &sim.plant.kalmanKH, &sim.plant.kalmanKt, &sim.plant.features,
+        &stepState.xRing, &stepState.cRing};
+    int m;
+    
+    for(m=0; m<9; m++)
+    {
+        if(*matrices[m]!=NULL)
+        {
+            mxFree(*matrices[m]);
+            *matrices[m] = NULL;
+        }
+    }
+    
+    freeSnapshot();
+}
\ No newline at end of file
@@ -0,0 +1,15 @@
+function [ name ] = simShardName( s )
+    %name = simShardName( s ) returns the name of shard s of a work queue made by
+    %makeSimShards (e.g. 'shard_000012'), without a file extension. The shard's files
+    %in every subdirectory of the queue start with this name, and all shard names
+    %have the same length.
+    %
+    %name = simShardName( ) returns a pattern that matches every shard name, for use
+    %with dir.
+    
+    if nargin<1
+        name = 'shard_*';
+    else
+        name = sprintf('shard_%06d', s);
+    end
+end
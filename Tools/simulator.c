@@ -8,13 +8,24 @@
 double euclidianDistance(double *x, double *y, int nElements);
 double euclidianNorm(double *x, int nElements);
 void nonlinIntegrate(int nElements, double *pos, double *newPos, double *vel, double loopTime, struct simPlant *plant); 
+void kalmanVelocityStep(struct simPlant *plant, double *prevVel, double *newVel, double *decodedInput);
 
 //This function does the actual simulation, using the parameters in the simulator struct to configure itself.
 //It simulates a single movement. 
 void simulate(struct simulator *sim)
 {
-    int done=0;
+    sim->nLoops = 1;
+    sim->timeInTarget = 0;
+    sim->done = 0;
     
+    simulateLoops(sim, -1);
+}
+
+//Continues the current movement until it is done, or until sim->nLoops exceeds maxLoops (if maxLoops>=0), so that
+//a movement can be simulated in parts (e.g. a prefix shared by several forks, see takeSnapshot).
+void simulateLoops(struct simulator *sim, int maxLoops)
+{
+
     //These are pointers describing the current index into each matrix. The xMatrix describes cursor state and the uMatrix
     //describes the user's decoded control vector. The xHatMatrix describes the user's internal model estimate of the cursor state.
     int xMatElement = 2 * sim->plant.nDim * sim->loopIdx;
@@ -22,123 +33,46 @@ void simulate(struct simulator *sim)
     int uMatElement = sim->plant.nDim * sim->loopIdx;
     int uMatDelayedElement = sim->plant.nDim * (sim->loopIdx - sim->forwardModel.delaySteps - 1);
     
-    double timeInTarget=0;
-    double targDist=0;
-    
-    double targDistHat=0;
-    double speedHat=0;
-    double posErrHat[MAX_DIM];
-    double cVecNorm=0;
-    
-    double fTargWeight=0;
-    double fVelWeight=0;
-    double noiseWeight=0;
-    double targComponent=0;
-    double velComponent=0;
-    double deadzoneToUse=0;
+    //the Kalman filter plant draws one noise sample per neural feature instead of one per dimension
+    int noiseRows = (sim->plant.decoderType==1) ? sim->plant.nFeatures : sim->plant.nDim;
     
-    double angle=0;
-    double prevAngle=0;
-    double angDiff = 0;
+    double targDist=0;
+    double deadzoneToUse = targetDeadzone(sim);
     
-    int nLoops = 1;
     int i;
-    int j;
-    
-    //the "target deadzone" control mode sets the control vector to zero when the cursor is on top of the target
-    if(sim->control.targetDeadzone==-1)
-    {
-        deadzoneToUse = sim->trial.targRad;
-    }
-    else
-    {
-        deadzoneToUse = sim->control.targetDeadzone;
-    }
     
-    while(!done){
+    while(!sim->done && ((maxLoops < 0) || (sim->nLoops <= maxLoops))){
         
         //Implement the forward model.
         //First, copy the delayed cursor state into the xHatMatrix, and then integrate forward from that state.
         memcpy(&(sim->xHatMatrix[xMatElement]), &(sim->xMatrix[xMatDelayedElement]), 2 * sim->plant.nDim * sizeof(double)); 
         for(i=0; i<sim->forwardModel.forwardSteps; i++){
-            //Step forward the velocity part of the cursor state.
-            for(j=0; j<sim->plant.nDim; j++){
-                //new_velocity = alpha*previous_velocity + beta*(1-alpha)*decoded_control_vector
-                sim->xHatMatrix[xMatElement + sim->plant.nDim + j] = sim->plant.alpha * sim->xHatMatrix[xMatElement + sim->plant.nDim + j] + 
-                    sim->plant.beta * (1-sim->plant.alpha) * sim->cMatrix[uMatDelayedElement + j + i*sim->plant.nDim];
-            }
-            
-            //Integrate the velocities into changes in position.
-            nonlinIntegrate(sim->plant.nDim, &(sim->xHatMatrix[xMatElement]), &(sim->xHatMatrix[xMatElement]), 
-                    &(sim->xHatMatrix[xMatElement + sim->plant.nDim]), sim->loopTime, &(sim->plant));
-        }
-        
-        //Implement the control policy. Basically, get the estimated speed and distance from the target, then apply fTarg and fVel. 
-        for(j=0; j<sim->plant.nDim; j++){
-            posErrHat[j] = sim->trial.targetPos[j] - sim->xHatMatrix[xMatElement + j];
-        }
-        targDistHat = euclidianNorm(posErrHat, sim->plant.nDim);
-        speedHat = euclidianNorm(&(sim->xHatMatrix[xMatElement + sim->plant.nDim]), sim->plant.nDim);
-        
-        fTargWeight = pwl_value_1d_scalar(sim->control.nfTarg, sim->control.fTargX, sim->control.fTargY, targDistHat);
-        fVelWeight = pwl_value_1d_scalar(sim->control.nfVel, sim->control.fVelX, sim->control.fVelY, speedHat);
-        
-        for(j=0; j<sim->plant.nDim; j++){
-            if(targDistHat==0)
-                targComponent=0;
-            else
-                targComponent=(posErrHat[j]/targDistHat)*fTargWeight;
-            
-            if(speedHat==0)
-                velComponent=0;
-            else
-                velComponent=(sim->xHatMatrix[xMatElement + sim->plant.nDim + j]/speedHat)*fVelWeight;
-            
-            sim->cMatrix[uMatElement + j] = targComponent + velComponent;
+            internalModelStep(sim, &(sim->xHatMatrix[xMatElement]), &(sim->cMatrix[uMatDelayedElement + i*sim->plant.nDim]));
         }
         
-        //target deadzone, or reaction time period, sets control vector to zero
-        if((targDistHat <= deadzoneToUse) || (nLoops <= sim->control.rtSteps)){
-            for(j=0; j<sim->plant.nDim; j++){
-                sim->cMatrix[uMatElement + j] = 0;
-            }
-        }
-        
-        //Apply noise, drawn from the noise matrix
-        cVecNorm = euclidianNorm(&(sim->cMatrix[uMatElement]), sim->plant.nDim);
-        noiseWeight = pwl_value_1d_scalar(sim->noise.nsdn, sim->noise.sdnX, sim->noise.sdnY, cVecNorm);
-        for(j=0; j<sim->plant.nDim; j++){
-            sim->uMatrix[uMatElement + j] = sim->cMatrix[uMatElement + j] + (sim->noise.noiseMatrix[sim->noise.noiseIdx*sim->plant.nDim + j])*noiseWeight;
-        }
+        //Implement the control policy, then apply noise drawn from the noise matrix.
+        controlPolicy(sim, &(sim->xHatMatrix[xMatElement]), sim->nLoops, deadzoneToUse, &(sim->cMatrix[uMatElement]));
+        decodeControlVector(sim, &(sim->cMatrix[uMatElement]), &(sim->noise.noiseMatrix[sim->noise.noiseIdx*noiseRows]), &(sim->uMatrix[uMatElement]));
         
         //Step forward the actual cursor.  
-        //Step velocity forward.
-        for(j=0; j<sim->plant.nDim; j++){
-            //new_velocity = alpha*previous_velocity + beta*(1-alpha)*decoded_control_vector
-            sim->xMatrix[xMatElement + sim->plant.nDim + j] = sim->plant.alpha * sim->xMatrix[xMatElement - sim->plant.nDim + j] + 
-                    sim->plant.beta * (1-sim->plant.alpha) * sim->uMatrix[uMatElement + j];
-        }
-        
-        //Integrate velocity to change in position.
-        nonlinIntegrate(sim->plant.nDim, &(sim->xMatrix[xMatElement - 2*sim->plant.nDim]), &(sim->xMatrix[xMatElement]), 
-            &(sim->xMatrix[xMatElement + sim->plant.nDim]), sim->loopTime, &(sim->plant));
+        plantStep(sim, &(sim->xMatrix[xMatElement - 2*sim->plant.nDim]), &(sim->xMatrix[xMatElement]), &(sim->uMatrix[uMatElement]));
 
         //Implement target acquisition rules.
         targDist = euclidianDistance(&(sim->xMatrix[xMatElement]), sim->trial.targetPos, sim->plant.nDim);
         if(targDist < sim->trial.targRad)
         {
-            timeInTarget+=sim->loopTime;
+            sim->timeInTarget+=sim->loopTime;
         }
         else if(sim->trial.continuousHoldRule)
         {
-            timeInTarget=0;
+            sim->timeInTarget=0;
         }
         
-        if((timeInTarget>=sim->trial.dwellTime) || ((nLoops * sim->loopTime) >= sim->trial.maxTrialTime))
-            done = 1;
+        if((sim->timeInTarget>=sim->trial.dwellTime) || ((sim->nLoops * sim->loopTime) >= sim->trial.maxTrialTime))
+            sim->done = 1;
         
         //Increment array indices
-        nLoops = nLoops + 1;
+        sim->nLoops = sim->nLoops + 1;
         
         xMatElement = xMatElement + 2 * sim->plant.nDim; 
         xMatDelayedElement = xMatDelayedElement + 2 * sim->plant.nDim; 
@@ -152,6 +86,287 @@ void simulate(struct simulator *sim)
     }
 }
 
+//Saves the full state of a partially simulated movement: the trial, the history in the state and control vector matrices
+//(columns 0 to loopIdx-1), the noise position, the time in target and the loop counters. The snapshot matrices must 
+//have room for sim->maxLoops columns.
+void takeSnapshot(struct simulator *sim, struct simSnapshot *snap)
+{
+    int nDim = sim->plant.nDim;
+    
+    snap->trial = sim->trial;
+    snap->loopIdx = sim->loopIdx;
+    snap->nLoops = sim->nLoops;
+    snap->noiseIdx = sim->noise.noiseIdx;
+    snap->timeInTarget = sim->timeInTarget;
+    snap->done = sim->done;
+    
+    memcpy(snap->xMatrix, sim->xMatrix, 2 * nDim * sim->loopIdx * sizeof(double));
+    memcpy(snap->xHatMatrix, sim->xHatMatrix, 2 * nDim * sim->loopIdx * sizeof(double));
+    memcpy(snap->uMatrix, sim->uMatrix, nDim * sim->loopIdx * sizeof(double));
+    memcpy(snap->cMatrix, sim->cMatrix, nDim * sim->loopIdx * sizeof(double));
+}
+
+//Restores a snapshot into the simulator, whose matrices must have room for sim->maxLoops columns. Continuing the 
+//movement with simulateLoops then gives the same result as if it had never been interrupted (for the same options).
+void restoreSnapshot(struct simulator *sim, struct simSnapshot *snap)
+{
+    int nDim = sim->plant.nDim;
+    
+    sim->trial = snap->trial;
+    sim->loopIdx = snap->loopIdx;
+    sim->nLoops = snap->nLoops;
+    sim->noise.noiseIdx = snap->noiseIdx;
+    sim->timeInTarget = snap->timeInTarget;
+    sim->done = snap->done;
+    
+    memcpy(sim->xMatrix, snap->xMatrix, 2 * nDim * snap->loopIdx * sizeof(double));
+    memcpy(sim->xHatMatrix, snap->xHatMatrix, 2 * nDim * snap->loopIdx * sizeof(double));
+    memcpy(sim->uMatrix, snap->uMatrix, nDim * snap->loopIdx * sizeof(double));
+    memcpy(sim->cMatrix, snap->cMatrix, nDim * snap->loopIdx * sizeof(double));
+}
+
+//the "target deadzone" control mode sets the control vector to zero when the cursor is on top of the target
+double targetDeadzone(struct simulator *sim)
+{
+    if(sim->control.targetDeadzone==-1)
+        return sim->trial.targRad;
+    else
+        return sim->control.targetDeadzone;
+}
+
+//Steps the user's internal model estimate of the cursor state (xHat, 2*nDim) forward by one time step, given the
+//control vector c that was issued at that time step.
+void internalModelStep(struct simulator *sim, double *xHat, double *c)
+{
+    double decodedInputHat[MAX_DIM];
+    int j;
+    
+    //Step forward the velocity part of the cursor state.
+    if(sim->plant.decoderType==1){
+        //the user's internal model of the Kalman filter is the noise-free decoder, vel = (I-K*H)*A*vel + K*H*c
+        matVec(decodedInputHat, sim->plant.kalmanKH, c, sim->plant.nDim, sim->plant.nDim);
+        kalmanVelocityStep(&(sim->plant), &(xHat[sim->plant.nDim]), &(xHat[sim->plant.nDim]), decodedInputHat);
+    }
+    else{
+        for(j=0; j<sim->plant.nDim; j++){
+            //new_velocity = alpha*previous_velocity + beta*(1-alpha)*decoded_control_vector
+            xHat[sim->plant.nDim + j] = sim->plant.alpha * xHat[sim->plant.nDim + j] + sim->plant.beta * (1-sim->plant.alpha) * c[j];
+        }
+    }
+    
+    //Integrate the velocities into changes in position.
+    nonlinIntegrate(sim->plant.nDim, xHat, xHat, &(xHat[sim->plant.nDim]), sim->loopTime, &(sim->plant));
+}
+
+//Implements the control policy. Basically, get the estimated speed and distance from the target (from the internal model
+//estimate xHat), then apply fTarg and fVel. nLoops counts time steps from the start of the movement (starting at 1).
+void controlPolicy(struct simulator *sim, double *xHat, int nLoops, double deadzoneToUse, double *c)
+{
+    double targDistHat=0;
+    double speedHat=0;
+    double posErrHat[MAX_DIM];
+    double fTargWeight=0;
+    double fVelWeight=0;
+    double targComponent=0;
+    double velComponent=0;
+    int j;
+    
+    for(j=0; j<sim->plant.nDim; j++){
+        posErrHat[j] = sim->trial.targetPos[j] - xHat[j];
+    }
+    targDistHat = euclidianNorm(posErrHat, sim->plant.nDim);
+    speedHat = euclidianNorm(&(xHat[sim->plant.nDim]), sim->plant.nDim);
+    
+    fTargWeight = pwl_value_1d_scalar(sim->control.nfTarg, sim->control.fTargX, sim->control.fTargY, targDistHat);
+    fVelWeight = pwl_value_1d_scalar(sim->control.nfVel, sim->control.fVelX, sim->control.fVelY, speedHat);
+    
+    for(j=0; j<sim->plant.nDim; j++){
+        if(targDistHat==0)
+            targComponent=0;
+        else
+            targComponent=(posErrHat[j]/targDistHat)*fTargWeight;
+        
+        if(speedHat==0)
+            velComponent=0;
+        else
+            velComponent=(xHat[sim->plant.nDim + j]/speedHat)*fVelWeight;
+        
+        c[j] = targComponent + velComponent;
+    }
+    
+    //target deadzone, or reaction time period, sets control vector to zero
+    if((targDistHat <= deadzoneToUse) || (nLoops <= sim->control.rtSteps)){
+        for(j=0; j<sim->plant.nDim; j++){
+            c[j] = 0;
+        }
+    }
+}
+
+//Applies (signal-dependent) noise to the control vector c and decodes it into u, the input that is added to the cursor
+//velocity. noise holds nDim samples for the (alpha, beta) plant, or one sample per neural feature for the Kalman filter.
+void decodeControlVector(struct simulator *sim, double *c, double *noise, double *u)
+{
+    double cVecNorm;
+    double noiseWeight;
+    int j;
+    
+    cVecNorm = euclidianNorm(c, sim->plant.nDim);
+    noiseWeight = pwl_value_1d_scalar(sim->noise.nsdn, sim->noise.sdnX, sim->noise.sdnY, cVecNorm);
+    if(sim->plant.decoderType==1){
+        //Generate the neural features from the control vector, add feature noise, and decode them. 
+        //For the Kalman filter, u is the decoded input K*features that is added to the velocity.
+        matVec(sim->plant.features, sim->plant.H, c, sim->plant.nFeatures, sim->plant.nDim);
+        for(j=0; j<sim->plant.nFeatures; j++){
+            sim->plant.features[j] += noise[j]*noiseWeight;
+        }
+        matTransVec(u, sim->plant.kalmanKt, sim->plant.features, sim->plant.nFeatures, sim->plant.nDim);
+    }
+    else{
+        for(j=0; j<sim->plant.nDim; j++){
+            u[j] = c[j] + noise[j]*noiseWeight;
+        }
+    }
+}
+
+//Steps the cursor state forward from prevX to newX (both 2*nDim) using the decoded input u.
+void plantStep(struct simulator *sim, double *prevX, double *newX, double *u)
+{
+    int j;
+    
+    //Step velocity forward.
+    if(sim->plant.decoderType==1){
+        kalmanVelocityStep(&(sim->plant), &(prevX[sim->plant.nDim]), &(newX[sim->plant.nDim]), u);
+    }
+    else{
+        for(j=0; j<sim->plant.nDim; j++){
+            //new_velocity = alpha*previous_velocity + beta*(1-alpha)*decoded_control_vector
+            newX[sim->plant.nDim + j] = sim->plant.alpha * prevX[sim->plant.nDim + j] + sim->plant.beta * (1-sim->plant.alpha) * u[j];
+        }
+    }
+    
+    //Integrate velocity to change in position.
+    nonlinIntegrate(sim->plant.nDim, prevX, newX, &(newX[sim->plant.nDim]), sim->loopTime, &(sim->plant));
+}
+
+//precomputes the steady-state Kalman filter matrices used by simulate() from plant->K, plant->H and plant->A
+//(the kalmanM, kalmanKH and kalmanKt arrays must already be allocated)
+void precomputeKalmanPlant(struct simPlant *plant){
+    int nDim = plant->nDim;
+    int nFeatures = plant->nFeatures;
+    int r;
+    int c;
+    int n;
+    double tmp;
+    
+    for(r=0; r<nDim; r++){
+        for(c=0; c<nDim; c++){
+            tmp = 0;
+            for(n=0; n<nFeatures; n++){
+                tmp = tmp + plant->K[r + n*nDim] * plant->H[n + c*nFeatures];
+            }
+            plant->kalmanKH[r + c*nDim] = tmp;
+        }
+    }
+    
+    for(r=0; r<nDim; r++){
+        for(c=0; c<nDim; c++){
+            tmp = plant->A[r + c*nDim];
+            for(n=0; n<nDim; n++){
+                tmp = tmp - plant->kalmanKH[r + n*nDim] * plant->A[n + c*nDim];
+            }
+            plant->kalmanM[r + c*nDim] = tmp;
+        }
+    }
+    
+    for(r=0; r<nDim; r++){
+        for(n=0; n<nFeatures; n++){
+            plant->kalmanKt[n + r*nFeatures] = plant->K[r + n*nDim];
+        }
+    }
+}
+
+//new_velocity = (I-K*H)*A*previous_velocity + decoded_input; newVel may be the same array as prevVel
+void kalmanVelocityStep(struct simPlant *plant, double *prevVel, double *newVel, double *decodedInput){
+    double tmp[MAX_DIM];
+    int j;
+    
+    matVec(tmp, plant->kalmanM, prevVel, plant->nDim, plant->nDim);
+    for(j=0; j<plant->nDim; j++){
+        newVel[j] = tmp[j] + decodedInput[j];
+    }
+}
+
+//out = M*x, where M is a column major (nRows x nCols) matrix and out does not overlap x. 
+//Four rows are accumulated per pass in local sums, so each element of out is written once, and the loads from M in the
+//inner loop are contiguous. Blocking over rows rather than columns also covers H*c, which has many rows (one per neural 
+//feature) but only nDim columns.
+void matVec(double *out, double *M, double *x, int nRows, int nCols){
+    double *m;
+    double xj;
+    double o0;
+    double o1;
+    double o2;
+    double o3;
+    int i;
+    int j;
+    
+    for(i=0; i+3<nRows; i+=4){
+        o0 = 0;
+        o1 = 0;
+        o2 = 0;
+        o3 = 0;
+        for(j=0; j<nCols; j++){
+            m = &(M[i + j*nRows]);
+            xj = x[j];
+            o0 = o0 + m[0]*xj;
+            o1 = o1 + m[1]*xj;
+            o2 = o2 + m[2]*xj;
+            o3 = o3 + m[3]*xj;
+        }
+        out[i] = o0;
+        out[i+1] = o1;
+        out[i+2] = o2;
+        out[i+3] = o3;
+    }
+    for(; i<nRows; i++){
+        o0 = 0;
+        for(j=0; j<nCols; j++){
+            o0 = o0 + M[i + j*nRows]*x[j];
+        }
+        out[i] = o0;
+    }
+}
+
+//out = M'*x, where M is a column major (nRows x nCols) matrix, i.e. one dot product per column of M.
+//Each dot product keeps four independent partial sums so that long columns (many neural features) pipeline well.
+void matTransVec(double *out, double *M, double *x, int nRows, int nCols){
+    double *m;
+    double s0;
+    double s1;
+    double s2;
+    double s3;
+    int i;
+    int j;
+    
+    for(j=0; j<nCols; j++){
+        m = &(M[j*nRows]);
+        s0 = 0;
+        s1 = 0;
+        s2 = 0;
+        s3 = 0;
+        for(i=0; i+3<nRows; i+=4){
+            s0 = s0 + m[i]*x[i];
+            s1 = s1 + m[i+1]*x[i+1];
+            s2 = s2 + m[i+2]*x[i+2];
+            s3 = s3 + m[i+3]*x[i+3];
+        }
+        for(; i<nRows; i++){
+            s0 = s0 + m[i]*x[i];
+        }
+        out[j] = (s0 + s1) + (s2 + s3);
+    }
+}
+
 //computes euclidian distance between x and y
 double euclidianDistance(double *x, double *y, int nElements){
     double tmp=0;
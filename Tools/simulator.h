@@ -6,6 +6,9 @@
 #define MAX_PWL_KNOTS 100
 #define MAX_DIM 100
 
+//alpha, beta, then the fTargY knots, then the fVelY knots
+#define MAX_SENS_PARAMS (2 + 2*MAX_PWL_KNOTS)
+
 //the MATLAB function makeBciSimOptions defines many of these variables
 
 struct simTrial {
@@ -29,6 +32,23 @@ struct simPlant {
     int nfStatic;
     double fStaticX[MAX_PWL_KNOTS];
     double fStaticY[MAX_PWL_KNOTS];
+    
+    //decoderType==0 uses the reduced (alpha, beta) plant above. decoderType==1 simulates a steady-state Kalman filter
+    //that decodes nFeatures neural features: features = H*controlVector + noise, vel = A*vel + K*(features - H*A*vel).
+    //K (nDim x nFeatures), H (nFeatures x nDim) and A (nDim x nDim) are column major.
+    int decoderType;
+    int nFeatures;
+    double *K;
+    double *H;
+    double *A;
+    
+    //precomputed by precomputeKalmanPlant: kalmanM = (I-K*H)*A and kalmanKH = K*H (both nDim x nDim), the transpose of
+    //K (nFeatures x nDim, so that each decoded dimension is a contiguous dot product), and a work vector that holds the
+    //neural features of the current time step
+    double *kalmanM;
+    double *kalmanKH;
+    double *kalmanKt;
+    double *features;
 };
 
 struct simForwardModel {
@@ -59,11 +79,31 @@ struct simController {
     int rtSteps;
 };
 
+//Forward-mode sensitivities used by simulateSensitivity. Every state value carries a tangent vector with one entry
+//per parameter (alpha, beta, fTargY knots, fVelY knots, in that order).
+struct simSensitivity {
+    int nParams;
+    
+    //These are (2*nDim*nParams x maxLoops) and (nDim*nParams x maxLoops) column major matrices that store the
+    //tangents of xMatrix and cMatrix. The tangent vector of each state element is stored contiguously.
+    double *dxMatrix;
+    double *dcMatrix;
+    
+    //the trial cost (time integral of the cursor's distance to the target) and its gradient
+    double cost;
+    double costGrad[MAX_SENS_PARAMS];
+};
+
 struct simulator {
     int loopIdx;
     int maxLoops;
     double loopTime;
     
+    //progress of the current movement, kept here so that a movement can be paused and continued (simulateLoops)
+    int nLoops;
+    double timeInTarget;
+    int done;
+    
     //These are (nDim x maxLoops) or (2*nDim x maxLoops) column major matrices that
     //store the cursor state (xMatrix), decoded control vector (uMatrix), control vector (cMatrix),
     //and the internal model estiamte of the cursor state (xHatMatrix)
@@ -77,8 +117,59 @@ struct simulator {
     struct simPlant plant;
     struct simNoise noise;
     struct simController control;
+    struct simSensitivity sens;
+};
+
+//Full state of a partially simulated movement, used to simulate a shared prefix once and fork several continuations
+//from it. The matrices have the same layout as in struct simulator and hold columns 0 to loopIdx-1.
+struct simSnapshot {
+    struct simTrial trial;
+    int loopIdx;
+    int nLoops;
+    int noiseIdx;
+    double timeInTarget;
+    int done;
+    
+    double *xMatrix;
+    double *uMatrix;
+    double *cMatrix;
+    double *xHatMatrix;
+};
+
+//State of the single-step closed-loop interface (simulatorStep.c), used to drive the simulated user from an external
+//real-time loop. The history needed by the forward model is kept in fixed ring buffers that are allocated once.
+struct simStepState {
+    //ringSize is a power of two that is at least delaySteps+2, so ring indices are loopIdx & (ringSize-1)
+    int ringSize;
+    double *xRing;    //(2*nDim x ringSize) cursor states
+    double *cRing;    //(nDim x ringSize) control vectors
+    
+    int loopIdx;      //index of the most recent cursor state
+    int nLoops;       //time steps since the reset, as in simulate()
+    double timeInTarget;
+    double deadzoneToUse;
+    
+    //the user's internal model estimate and control vector for the next time step, and the last decoded input
+    double xHat[2*MAX_DIM];
+    double *c;
+    double u[MAX_DIM];
 };
 
 void simulate(struct simulator *sim);
+void simulateLoops(struct simulator *sim, int maxLoops);
+void takeSnapshot(struct simulator *sim, struct simSnapshot *snap);
+void restoreSnapshot(struct simulator *sim, struct simSnapshot *snap);
+int stepRingSize(struct simulator *sim);
+void stepReset(struct simulator *sim, struct simStepState *state, double *initX, double *initC, int nInitCols);
+int step(struct simulator *sim, struct simStepState *state, double *input, int inputIsDecoded);
+double targetDeadzone(struct simulator *sim);
+void internalModelStep(struct simulator *sim, double *xHat, double *c);
+void controlPolicy(struct simulator *sim, double *xHat, int nLoops, double deadzoneToUse, double *c);
+void decodeControlVector(struct simulator *sim, double *c, double *noise, double *u);
+void plantStep(struct simulator *sim, double *prevX, double *newX, double *u);
+void precomputeKalmanPlant(struct simPlant *plant);
+void matVec(double *out, double *M, double *x, int nRows, int nCols);
+void matTransVec(double *out, double *M, double *x, int nRows, int nCols);
+void simulateSensitivity(struct simulator *sim);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,344 @@
+//Forward-mode (dual number) differentiation of the simulator. simulateSensitivity runs exactly the same movement as
+//simulate() but carries a tangent vector alongside every state value, so that one run returns the gradient of the
+//trial cost with respect to alpha, beta and the fTargY/fVelY knot values.
+//Discrete events (the reaction time period, the target deadzone and the end of the trial) are treated as fixed, so the
+//gradient is that of the trajectory that was actually taken.
+
+#include <math.h>
+#include <string.h>
+#include "mex.h"
+#include "simulator.h"
+#include "pwl_interp_1d.h"
+
+#define SENS_ALPHA 0
+#define SENS_BETA 1
+#define SENS_FTARG 2
+
+double euclidianDistance(double *x, double *y, int nElements);
+double euclidianNorm(double *x, int nElements);
+void nonlinIntegrate(int nElements, double *pos, double *newPos, double *vel, double loopTime, struct simPlant *plant);
+
+void normTangent(int nElements, int nParams, double *x, double *dx, double norm, double *dNorm);
+void velocityTangent(int nElements, int nParams, struct simPlant *plant, double *prevVel, double *dPrevVel, double *u, double *du, double *dNewVel);
+void nonlinIntegrateTangent(int nElements, int nParams, double *dPos, double *dNewPos, double *vel, double *dVel, double loopTime, struct simPlant *plant);
+double speedRatio(double speed, struct simPlant *plant, double *dRatio);
+
+void simulateSensitivity(struct simulator *sim)
+{
+    int done=0;
+    int nDim = sim->plant.nDim;
+    int nParams = sim->sens.nParams;
+    int fVelOffset = SENS_FTARG + sim->control.nfTarg;
+
+    //same indexing as simulate()
+    int xMatElement = 2 * nDim * sim->loopIdx;
+    int xMatDelayedElement = 2 * nDim * (sim->loopIdx - sim->forwardModel.delaySteps - 1);
+    int uMatElement = nDim * sim->loopIdx;
+    int uMatDelayedElement = nDim * (sim->loopIdx - sim->forwardModel.delaySteps - 1);
+
+    double timeInTarget=0;
+    double targDist=0;
+
+    double targDistHat=0;
+    double speedHat=0;
+    double posErrHat[MAX_DIM];
+    double posErr[MAX_DIM];
+    double cVecNorm=0;
+
+    double fTargWeight=0;
+    double fVelWeight=0;
+    double noiseWeight=0;
+    double targComponent=0;
+    double velComponent=0;
+    double deadzoneToUse=0;
+
+    //derivatives of the piecewise linear lookups
+    double fTargSlope=0;
+    double fVelSlope=0;
+    double noiseSlope=0;
+    double tHigh=0;
+    int kLow=0;
+
+    //tangent work vectors for the current step (the internal model state and the decoded control vector are not needed
+    //after the step they are computed in)
+    double *dxHat = mxCalloc(2 * nDim * nParams, sizeof(double));
+    double *dPosErrHat = mxCalloc(nDim * nParams, sizeof(double));
+    double *du = mxCalloc(nDim * nParams, sizeof(double));
+    double *dTargDistHat = mxCalloc(nParams, sizeof(double));
+    double *dSpeedHat = mxCalloc(nParams, sizeof(double));
+    double *dfTargWeight = mxCalloc(nParams, sizeof(double));
+    double *dfVelWeight = mxCalloc(nParams, sizeof(double));
+    double *dcVecNorm = mxCalloc(nParams, sizeof(double));
+    double *dTargDist = mxCalloc(nParams, sizeof(double));
+    double *dc;
+    double *dx;
+
+    int nLoops = 1;
+    int i;
+    int j;
+    int p;
+
+    if(sim->control.targetDeadzone==-1)
+    {
+        deadzoneToUse = sim->trial.targRad;
+    }
+    else
+    {
+        deadzoneToUse = sim->control.targetDeadzone;
+    }
+
+    sim->sens.cost = 0;
+    memset(sim->sens.costGrad, 0, nParams*sizeof(double));
+
+    while(!done){
+        dc = &(sim->sens.dcMatrix[uMatElement * nParams]);
+        dx = &(sim->sens.dxMatrix[xMatElement * nParams]);
+
+        //Forward model, starting from the delayed cursor state and its tangent.
+        memcpy(&(sim->xHatMatrix[xMatElement]), &(sim->xMatrix[xMatDelayedElement]), 2 * nDim * sizeof(double));
+        memcpy(dxHat, &(sim->sens.dxMatrix[xMatDelayedElement * nParams]), 2 * nDim * nParams * sizeof(double));
+        for(i=0; i<sim->forwardModel.forwardSteps; i++){
+            //the tangent update needs the velocity from before this step, so it comes first
+            velocityTangent(nDim, nParams, &(sim->plant), &(sim->xHatMatrix[xMatElement + nDim]), &(dxHat[nDim * nParams]),
+                    &(sim->cMatrix[uMatDelayedElement + i*nDim]), &(sim->sens.dcMatrix[(uMatDelayedElement + i*nDim) * nParams]), &(dxHat[nDim * nParams]));
+            for(j=0; j<nDim; j++){
+                sim->xHatMatrix[xMatElement + nDim + j] = sim->plant.alpha * sim->xHatMatrix[xMatElement + nDim + j] +
+                    sim->plant.beta * (1-sim->plant.alpha) * sim->cMatrix[uMatDelayedElement + j + i*nDim];
+            }
+
+            nonlinIntegrate(nDim, &(sim->xHatMatrix[xMatElement]), &(sim->xHatMatrix[xMatElement]),
+                    &(sim->xHatMatrix[xMatElement + nDim]), sim->loopTime, &(sim->plant));
+            nonlinIntegrateTangent(nDim, nParams, dxHat, dxHat, &(sim->xHatMatrix[xMatElement + nDim]), &(dxHat[nDim * nParams]),
+                    sim->loopTime, &(sim->plant));
+        }
+
+        //Control policy.
+        for(j=0; j<nDim; j++){
+            posErrHat[j] = sim->trial.targetPos[j] - sim->xHatMatrix[xMatElement + j];
+            for(p=0; p<nParams; p++){
+                dPosErrHat[j*nParams + p] = -dxHat[j*nParams + p];
+            }
+        }
+        targDistHat = euclidianNorm(posErrHat, nDim);
+        speedHat = euclidianNorm(&(sim->xHatMatrix[xMatElement + nDim]), nDim);
+        normTangent(nDim, nParams, posErrHat, dPosErrHat, targDistHat, dTargDistHat);
+        normTangent(nDim, nParams, &(sim->xHatMatrix[xMatElement + nDim]), &(dxHat[nDim * nParams]), speedHat, dSpeedHat);
+
+        fTargWeight = pwl_value_1d_scalar_sens(sim->control.nfTarg, sim->control.fTargX, sim->control.fTargY, targDistHat, &fTargSlope, &kLow, &tHigh);
+        for(p=0; p<nParams; p++){
+            dfTargWeight[p] = fTargSlope * dTargDistHat[p];
+        }
+        dfTargWeight[SENS_FTARG + kLow] += 1 - tHigh;
+        if(tHigh>0)
+            dfTargWeight[SENS_FTARG + kLow + 1] += tHigh;
+
+        fVelWeight = pwl_value_1d_scalar_sens(sim->control.nfVel, sim->control.fVelX, sim->control.fVelY, speedHat, &fVelSlope, &kLow, &tHigh);
+        for(p=0; p<nParams; p++){
+            dfVelWeight[p] = fVelSlope * dSpeedHat[p];
+        }
+        dfVelWeight[fVelOffset + kLow] += 1 - tHigh;
+        if(tHigh>0)
+            dfVelWeight[fVelOffset + kLow + 1] += tHigh;
+
+        for(j=0; j<nDim; j++){
+            for(p=0; p<nParams; p++){
+                dc[j*nParams + p] = 0;
+            }
+
+            if(targDistHat==0){
+                targComponent=0;
+            }
+            else{
+                targComponent=(posErrHat[j]/targDistHat)*fTargWeight;
+                for(p=0; p<nParams; p++){
+                    dc[j*nParams + p] += ((dPosErrHat[j*nParams + p]*targDistHat - posErrHat[j]*dTargDistHat[p])/(targDistHat*targDistHat))*fTargWeight +
+                        (posErrHat[j]/targDistHat)*dfTargWeight[p];
+                }
+            }
+
+            if(speedHat==0){
+                velComponent=0;
+            }
+            else{
+                velComponent=(sim->xHatMatrix[xMatElement + nDim + j]/speedHat)*fVelWeight;
+                for(p=0; p<nParams; p++){
+                    dc[j*nParams + p] += ((dxHat[(nDim + j)*nParams + p]*speedHat - sim->xHatMatrix[xMatElement + nDim + j]*dSpeedHat[p])/(speedHat*speedHat))*fVelWeight +
+                        (sim->xHatMatrix[xMatElement + nDim + j]/speedHat)*dfVelWeight[p];
+                }
+            }
+
+            sim->cMatrix[uMatElement + j] = targComponent + velComponent;
+        }
+
+        if((targDistHat <= deadzoneToUse) || (nLoops <= sim->control.rtSteps)){
+            for(j=0; j<nDim; j++){
+                sim->cMatrix[uMatElement + j] = 0;
+            }
+            memset(dc, 0, nDim * nParams * sizeof(double));
+        }
+
+        //Noise. The noise samples themselves are constants; only the signal-dependent weight has a tangent.
+        cVecNorm = euclidianNorm(&(sim->cMatrix[uMatElement]), nDim);
+        normTangent(nDim, nParams, &(sim->cMatrix[uMatElement]), dc, cVecNorm, dcVecNorm);
+        noiseWeight = pwl_value_1d_scalar_sens(sim->noise.nsdn, sim->noise.sdnX, sim->noise.sdnY, cVecNorm, &noiseSlope, &kLow, &tHigh);
+        for(j=0; j<nDim; j++){
+            sim->uMatrix[uMatElement + j] = sim->cMatrix[uMatElement + j] + (sim->noise.noiseMatrix[sim->noise.noiseIdx*nDim + j])*noiseWeight;
+            for(p=0; p<nParams; p++){
+                du[j*nParams + p] = dc[j*nParams + p] + (sim->noise.noiseMatrix[sim->noise.noiseIdx*nDim + j])*noiseSlope*dcVecNorm[p];
+            }
+        }
+
+        //Cursor dynamics.
+        velocityTangent(nDim, nParams, &(sim->plant), &(sim->xMatrix[xMatElement - nDim]), &(dx[-nDim * nParams]),
+                &(sim->uMatrix[uMatElement]), du, &(dx[nDim * nParams]));
+        for(j=0; j<nDim; j++){
+            sim->xMatrix[xMatElement + nDim + j] = sim->plant.alpha * sim->xMatrix[xMatElement - nDim + j] +
+                    sim->plant.beta * (1-sim->plant.alpha) * sim->uMatrix[uMatElement + j];
+        }
+
+        nonlinIntegrate(nDim, &(sim->xMatrix[xMatElement - 2*nDim]), &(sim->xMatrix[xMatElement]),
+            &(sim->xMatrix[xMatElement + nDim]), sim->loopTime, &(sim->plant));
+        nonlinIntegrateTangent(nDim, nParams, &(dx[-2 * nDim * nParams]), dx, &(sim->xMatrix[xMatElement + nDim]), &(dx[nDim * nParams]),
+                sim->loopTime, &(sim->plant));
+
+        //Accumulate the cost and apply the target acquisition rules.
+        targDist = euclidianDistance(&(sim->xMatrix[xMatElement]), sim->trial.targetPos, nDim);
+        for(j=0; j<nDim; j++){
+            posErr[j] = sim->xMatrix[xMatElement + j] - sim->trial.targetPos[j];
+        }
+        normTangent(nDim, nParams, posErr, dx, targDist, dTargDist);
+        sim->sens.cost += sim->loopTime * targDist;
+        for(p=0; p<nParams; p++){
+            sim->sens.costGrad[p] += sim->loopTime * dTargDist[p];
+        }
+
+        if(targDist < sim->trial.targRad)
+        {
+            timeInTarget+=sim->loopTime;
+        }
+        else if(sim->trial.continuousHoldRule)
+        {
+            timeInTarget=0;
+        }
+
+        if((timeInTarget>=sim->trial.dwellTime) || ((nLoops * sim->loopTime) >= sim->trial.maxTrialTime))
+            done = 1;
+
+        nLoops = nLoops + 1;
+
+        xMatElement = xMatElement + 2 * nDim;
+        xMatDelayedElement = xMatDelayedElement + 2 * nDim;
+        uMatElement = uMatElement + nDim;
+        uMatDelayedElement = uMatDelayedElement + nDim;
+        sim->loopIdx = sim->loopIdx + 1;
+
+        sim->noise.noiseIdx += 1;
+        if(sim->noise.noiseIdx >= sim->noise.nColsForNoiseMatrix)
+            sim->noise.noiseIdx = 0;
+    }
+
+    mxFree(dxHat);
+    mxFree(dPosErrHat);
+    mxFree(du);
+    mxFree(dTargDistHat);
+    mxFree(dSpeedHat);
+    mxFree(dfTargWeight);
+    mxFree(dfVelWeight);
+    mxFree(dcVecNorm);
+    mxFree(dTargDist);
+}
+
+//tangent of the euclidian norm of x, given the already computed norm (the norm is treated as flat at zero)
+void normTangent(int nElements, int nParams, double *x, double *dx, double norm, double *dNorm){
+    int j;
+    int p;
+
+    memset(dNorm, 0, nParams*sizeof(double));
+    if(norm==0)
+        return;
+
+    for(j=0; j<nElements; j++){
+        for(p=0; p<nParams; p++){
+            dNorm[p] += x[j] * dx[j*nParams + p] / norm;
+        }
+    }
+}
+
+//tangent of new_velocity = alpha*previous_velocity + beta*(1-alpha)*decoded_control_vector
+//dNewVel may be the same array as dPrevVel
+void velocityTangent(int nElements, int nParams, struct simPlant *plant, double *prevVel, double *dPrevVel, double *u, double *du, double *dNewVel){
+    int j;
+    int p;
+    double gain = plant->beta * (1-plant->alpha);
+
+    for(j=0; j<nElements; j++){
+        for(p=0; p<nParams; p++){
+            dNewVel[j*nParams + p] = plant->alpha * dPrevVel[j*nParams + p] + gain * du[j*nParams + p];
+        }
+        dNewVel[j*nParams + SENS_ALPHA] += prevVel[j] - plant->beta * u[j];
+        dNewVel[j*nParams + SENS_BETA] += (1-plant->alpha) * u[j];
+    }
+}
+
+//tangent of nonlinIntegrate, where newPos = pos + loopTime*vel*speedRatio(speed)
+//vel is the velocity that was integrated; dNewPos may be the same array as dPos
+void nonlinIntegrateTangent(int nElements, int nParams, double *dPos, double *dNewPos, double *vel, double *dVel, double loopTime, struct simPlant *plant){
+    int j;
+    int p;
+    double speed;
+    double ratio;
+    double dRatio;
+    double dSpeed[MAX_SENS_PARAMS];
+
+    speed = euclidianNorm(vel, nElements);
+    ratio = speedRatio(speed, plant, &dRatio);
+    if(dRatio!=0)
+        normTangent(nElements, nParams, vel, dVel, speed, dSpeed);
+
+    for(j=0; j<nElements; j++){
+        for(p=0; p<nParams; p++){
+            dNewPos[j*nParams + p] = dPos[j*nParams + p] + loopTime * dVel[j*nParams + p] * ratio;
+            if(dRatio!=0)
+                dNewPos[j*nParams + p] += loopTime * vel[j] * dRatio * dSpeed[p];
+        }
+    }
+}
+
+//the factor that nonlinIntegrate scales the velocity by, and its derivative with respect to speed
+double speedRatio(double speed, struct simPlant *plant, double *dRatio){
+    double newSpeed;
+    double slope;
+    double ratio;
+    int kLow;
+    double tHigh;
+
+    *dRatio = 0;
+    if(plant->nonlinType==0 || speed==0)
+        return 1;
+
+    if(plant->nonlinType==1){
+        newSpeed = plant->n2 * pow(speed / plant->n2, plant->n1);
+        ratio = newSpeed/speed;
+        *dRatio = (plant->n1 - 1) * ratio / speed;
+    }
+    else if(plant->nonlinType==2){
+        newSpeed = speed - plant->n1;
+        if(newSpeed<0){
+            ratio = 0;
+        }
+        else{
+            ratio = newSpeed/speed;
+            *dRatio = plant->n1 / (speed*speed);
+        }
+    }
+    else if(plant->nonlinType==3){
+        newSpeed = pwl_value_1d_scalar_sens(plant->nfStatic, plant->fStaticX, plant->fStaticY, speed, &slope, &kLow, &tHigh);
+        ratio = newSpeed/speed;
+        *dRatio = (slope*speed - newSpeed) / (speed*speed);
+    }
+    else{
+        ratio = 1;
+    }
+
+    return ratio;
+}
@@ -0,0 +1,119 @@
+//Single-step closed-loop interface to the simulator, for driving the simulated user from an external real-time loop
+//(e.g. a live decoder test rig). stepReset loads a cursor state history and returns the first control vector; each call to
+//step then takes the decoded input for that control vector (or the noise to decode it with), moves the cursor, and computes
+//the next control vector. A step performs the same computations, in the same order, as one loop of simulate(),
+//so stepping with the noise samples of a noise matrix reproduces simulate() exactly.
+//
+//step() allocates nothing and parses no options. Its cost is one control policy evaluation plus forwardSteps internal 
+//model steps, which simBci 'stepTiming' measures (for a 2D (alpha, beta) plant, about 2.5 us with 200 forward model 
+//steps, and about 6 us for a Kalman filter plant with 192 neural features). Called from MATLAB, each 'step' also creates 
+//its output arrays, and the mex call overhead dominates (see benchmarkSimStep.m).
+
+#include <string.h>
+#include "mex.h"
+#include "simulator.h"
+
+double euclidianDistance(double *x, double *y, int nElements);
+void stepControl(struct simulator *sim, struct simStepState *state);
+
+//the ring buffer size needed for the current forward model settings
+int stepRingSize(struct simulator *sim)
+{
+    int ringSize = 1;
+    while(ringSize < sim->forwardModel.delaySteps + 2)
+        ringSize = ringSize * 2;
+    
+    return ringSize;
+}
+
+//Resets the trial to the cursor state history in initX (2*nDim x nInitCols) and control vector history in initC
+//(nDim x nInitCols), where the last column is the current cursor state. nInitCols must be at least delaySteps+1, and
+//state->xRing and state->cRing must already be allocated with stepRingSize(sim) columns. The first control
+//vector is left in state->c.
+void stepReset(struct simulator *sim, struct simStepState *state, double *initX, double *initC, int nInitCols)
+{
+    int nDim = sim->plant.nDim;
+    int mask = state->ringSize - 1;
+    int col;
+    
+    memset(state->xRing, 0, 2 * nDim * state->ringSize * sizeof(double));
+    memset(state->cRing, 0, nDim * state->ringSize * sizeof(double));
+    
+    //only the most recent columns fit in (and are needed from) the ring buffers
+    col = nInitCols - state->ringSize;
+    if(col < 0)
+        col = 0;
+    for(; col<nInitCols; col++){
+        memcpy(&(state->xRing[2 * nDim * (col & mask)]), &(initX[2 * nDim * col]), 2 * nDim * sizeof(double));
+        memcpy(&(state->cRing[nDim * (col & mask)]), &(initC[nDim * col]), nDim * sizeof(double));
+    }
+    
+    state->loopIdx = nInitCols - 1;
+    state->nLoops = 1;
+    state->timeInTarget = 0;
+    state->deadzoneToUse = targetDeadzone(sim);
+    memset(state->u, 0, nDim * sizeof(double));
+    
+    stepControl(sim, state);
+}
+
+//Advances the simulation by one time step. If inputIsDecoded, input is the decoded input (nDim) that is added to the 
+//cursor velocity, as produced by an external decoder from state->c. Otherwise, input is noise (nDim, or one sample per 
+//neural feature for the Kalman filter plant) that the simulator uses to decode state->c itself.
+//Afterwards, the new cursor state is xRing column state->loopIdx and the next control vector is state->c.
+//Returns 1 if the target has been acquired (the dwell time has been reached), otherwise 0.
+int step(struct simulator *sim, struct simStepState *state, double *input, int inputIsDecoded)
+{
+    int nDim = sim->plant.nDim;
+    int mask = state->ringSize - 1;
+    double *prevX = &(state->xRing[2 * nDim * (state->loopIdx & mask)]);
+    double *newX = &(state->xRing[2 * nDim * ((state->loopIdx + 1) & mask)]);
+    double targDist;
+    int j;
+    
+    if(inputIsDecoded){
+        for(j=0; j<nDim; j++){
+            state->u[j] = input[j];
+        }
+    }
+    else{
+        decodeControlVector(sim, state->c, input, state->u);
+    }
+    
+    plantStep(sim, prevX, newX, state->u);
+    state->loopIdx = state->loopIdx + 1;
+    
+    //target acquisition rules, as in simulate()
+    targDist = euclidianDistance(newX, sim->trial.targetPos, nDim);
+    if(targDist < sim->trial.targRad)
+    {
+        state->timeInTarget += sim->loopTime;
+    }
+    else if(sim->trial.continuousHoldRule)
+    {
+        state->timeInTarget = 0;
+    }
+    
+    state->nLoops = state->nLoops + 1;
+    stepControl(sim, state);
+    
+    return (state->timeInTarget >= sim->trial.dwellTime);
+}
+
+//computes the user's internal model estimate and control vector for the time step after state->loopIdx
+void stepControl(struct simulator *sim, struct simStepState *state)
+{
+    int nDim = sim->plant.nDim;
+    int mask = state->ringSize - 1;
+    int nextIdx = state->loopIdx + 1;
+    int delayedIdx = nextIdx - sim->forwardModel.delaySteps - 1;
+    int i;
+    
+    memcpy(state->xHat, &(state->xRing[2 * nDim * (delayedIdx & mask)]), 2 * nDim * sizeof(double));
+    for(i=0; i<sim->forwardModel.forwardSteps; i++){
+        internalModelStep(sim, state->xHat, &(state->cRing[nDim * ((delayedIdx + i) & mask)]));
+    }
+    
+    state->c = &(state->cRing[nDim * (nextIdx & mask)]);
+    controlPolicy(sim, state->xHat, state->nLoops, state->deadzoneToUse, state->c);
+}